@@ -32,58 +32,254 @@
     *
     * 1. Data Structures:
     *    - HashSlot: Represents a slot in the hash table, containing a character, count, payload, and a union for
-    *      either a child node or binary data.
+    *      either a child node or a leaf.
+    *    - LeafValue: The binary of a leaf and the range of its bytes still to compare at lookup.
     *    - HashNode: Represents a node in the hash table tree, containing column position, prime number for hashing,
-    *      number of slots, and an array of HashSlot structures.
+    *      number of slots, node flags, and an array of HashSlot structures. Set nodes (HASHNODE_SET) store their
+    *      slots without the payload, so slots must be addressed with HASHNODE_SLOT().
     *    - SLOT: A helper structure used to measure slots used by the find_best_hash function.
     *
     * 2. Hash Functions:
     *    - hash_function: Calculates the hash value for a given character.
-    *    - calculate_character_distribution: Calculates the distribution of characters in an array.
-    *    - find_best_hash: Generates the best hash table for the given characters.
+    *    - calculate_character_distribution: Calculates the distribution of characters in an array - counted into
+    *      interleaved 16 bit sub-histograms (histogram_block_body) and reduced in one vectorised pass.
+    *    - score_column: Scores a column's characters with the tree's column scoring policy (HashBuildOptions
+    *      column_scoring) - the largest group, the entropy or the sum of the squared group sizes.
+    *    - SimdKernels, simd_level, force_simd_level: The build kernels (count_bytes and the distribution of
+    *      calculate_character_distribution) are compiled for each x86 instruction set level (DEFINE_SIMD_KERNELS)
+    *      and the best level of the CPU is picked at startup (detect_simd_level) - or forced for benchmarking.
+    *    - find_best_hash, count_characters, find_hash_prime: Generate the best hash table for the given characters -
+    *      the characters are counted once and each a and table size is tried on the distinct characters alone.
+    *    - choose_layout, create_node: Lay the node out as the hash table or, when a lookup cost model (bytes plus
+    *      estimated lookup cycles) prefers it, as just the used slots found through keys stored before them - a
+    *      linear search (up to 4), a 16 byte SIMD compare (up to 16) or a 256 bit occupancy bitmap where the slot
+    *      is the rank of the character's bit (one popcount).
+    *    - node_slot: Finds the slot for a character in a node of any layout.
+    *    - find_best_wide_column, wide_node_pays_off, create_wide_node: Wide nodes (HASHNODE_COLUMN16, HashBuildOptions
+    *      wide_columns) read two adjacent columns as a 16 bit key with up to 65536 slots, found through a 64K bit
+    *      occupancy bitmap and popcount rank (HASHNODE_BITMAP16). They are used for large groups when they split
+    *      the values better than one column and the level they save pays for the bitmap.
+    *    - find_best_pair_columns: Pair nodes (HASHNODE_PAIR) hash two columns combined (PAIR_CHARACTER) when no
+    *      single column splits a group well, e.g. digits where each column has only ten values.
+    *    - select_beam_columns, choose_beam_column: Beam search column selection (HashBuildOptions beam_width) -
+    *      the best scoring columns are compared by building the subtree below each of them.
+    *    - build_bounded_node: Keeps lookups within a depth bound (HashBuildOptions max_depth) - a subtree that is too
+    *      deep is rebuilt on a wide node or other columns, with a bucket or a collision free node at the last level.
+    *    - build_budget_tree: Keeps a tree within a space budget (HashBuildOptions max_bytes) - trees are rebuilt
+    *      with the smallest node layouts (BuildContext compact), buckets and other column scoring until one fits.
+    *    - build_cancelled, build_placed, discard_tree: Progress callback and cancel flag (HashBuildOptions
+    *      progress, cancel) - the build counts the keys and nodes of the tree as it goes (taking off subtrees it
+    *      throws away), and a cancelled build fails at the next node and frees what it has built.
+    *    - run_parallel, build_parts: Threads for large nodes (HashBuildOptions threads, parallel_threshold, with
+    *      ACPH_THREADS) - score_columns scores a range of the candidate columns on each thread and
+    *      count_characters counts the characters of a node on the threads by range of the values. The results are
+    *      combined in the same order as a single threaded build.
+    *    - build_clock, build_expired: Build effort and time budget (HashBuildOptions effort, time_budget) - fast
+    *      builds, and builds past their deadline, take the natural table and score columns on a sample of large
+    *      groups (SAMPLE_VALUES); thorough builds add a beam search.
     *    - create_character_hash: Builds a hash table for characters/bytes provided as binary & length.
     *    - lookup_character: Looks up a character in the hash node.
-    *    - create_binary_hash: Builds the tree structure recursively from a set of binary buffers.
+    *    - create_binary_hash: Builds the tree structure recursively from a set of binary buffers. Each node passes
+    *      the columns that vary in its group to its children, so constant columns are scanned only once.
+    *    - create_binary_hash_ex, create_string_hash_ex: Build a tree with HashBuildOptions (mode, fingerprint size,
+    *      and length dispatch - a first HASHNODE_LENGTH node that hashes the key length bucket).
+    *    - binary_hash, binary_fingerprint: Hash a whole binary for filter fingerprints.
+    *    - leaf_fingerprint: The leaf prefilter - the slot holds the key length and an 8 bit fingerprint of the first
+    *      and last 8 bytes, so most misses are rejected without reading the stored binary.
     *    - compare_binaries: Compares two binary values.
+    *    - compare_leaf: Compares a binary with a leaf - only the bytes not matched on the path to the leaf (each
+    *      node checks its column character, so bytes at path columns are already known to match).
+    *    - build_bucket_node, lookup_bucket: Small groups of binaries (HashBuildOptions bucket_size) are kept in a
+    *      HASHNODE_BUCKET node of leaf slots rather than a child node; a lookup compares the packed leaf
+    *      fingerprints of all the slots in one word operation and then verifies the candidates.
     *    - lookup_binary: Compares a binary against the tree structure.
     *
     * 3. Utility Functions:
     *    - free_tree: Frees the tree structure recursively.
     *    - print_tree: Recursively prints the tree structure using a provided print_leaf function.
-    *    - print_string_leaf, print_int_leaf, print_double_leaf, print_char_leaf, print_binary_leaf: Helper functions
-    *      to print different types of leaf nodes.
+    *    - print_string_leaf, print_int_leaf, print_double_leaf, print_char_leaf, print_binary_leaf,
+    *      print_fingerprint_leaf, print_payload_leaf: Helper functions to print different types of leaf nodes.
     *    - create_string_hash, create_integer_hash, create_double_hash: Functions to create hash tables for strings,
     *      integers, and doubles respectively.
+    *    - create_character_set, create_binary_set, create_string_set, create_integer_set, create_double_set:
+    *      Functions to create membership only sets (no payload storage).
+    *    - create_binary_filter, create_string_filter, create_integer_filter, create_double_filter: Functions to
+    *      create approximate membership filters - the leaves keep an 8, 16 or 32 bit fingerprint (HASHNODE_FILTER)
+    *      rather than the key, so lookups can give false positives.
+    *    - create_binary_retrieval, create_string_retrieval, create_integer_retrieval, create_double_retrieval:
+    *      Functions to create retrieval only trees (HASHNODE_RETRIEVAL) - no keys are kept and leaves are not
+    *      verified, so non-members return an arbitrary payload.
     *    - lookup_string, lookup_integer, lookup_double: Functions to look up strings, integers, and doubles in the
-    *      hash node.
+    *      hash node. lookup_string does not take a strlen first - it reads the string only as far as the columns
+    *      visited and, at a leaf, one byte past the stored binary's length (StringCursor).
     *    - hash_efficiency: Utility function to return the efficiency of the hash table.
     *    - hash_table_efficiency: Prints and returns the efficiency of the hash table.
+    *    - hash_table_bytes, hash_table_budget: Return the bytes of the hash table and how much of a space budget it
+    *      uses.
+    *    - hash_table_average_depth: Returns the average number of nodes visited to find a key.
+    *    - lookup_binary_depth: Returns the number of nodes visited to look up a binary (e.g. to weigh a tree
+    *      against an access trace).
+    *    - relayout_tree: Copies a tree into one packed buffer ordered by the hits of a lookup trace - the hottest
+    *      nodes and leaves (with their keys) first, so hot lookups touch fewer cache lines and pages.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Build kernels are also compiled for wider x86 instruction sets and picked at startup (see simd_kernels)
+#define ACPH_X86_KERNELS
+#include <immintrin.h>
+#endif
+#ifdef ACPH_THREADS
+#include <pthread.h>
+#endif
 #include "acph.h"
 
-#define HASHNODE_SIZEFORNUMSLOTS(num_slots) sizeof(HashNode) + (((int)(num_slots) + 1) * sizeof(HashSlot))
+// Node flags
+#define HASHNODE_SET 0x01    // Set (membership only) node - the slots have no payload
+#define HASHNODE_FILTER 0x02 // Filter node - leaves hold a key fingerprint rather than the key (always a set)
+#define HASHNODE_RETRIEVAL 0x04 // Retrieval node - leaves hold only the payload, keys are never verified
+#define HASHNODE_KEYLESS (HASHNODE_FILTER | HASHNODE_RETRIEVAL) // Leaves do not point to a BinaryValue
+#define HASHNODE_PACKED 0x08 // Node is in the buffer of a packed tree (relayout_tree()) - only the root is freed
+
+// Node kinds - what a node hashes
+#define HASHNODE_COLUMN 0 // The byte at the node's column
+#define HASHNODE_LENGTH 1 // The length bucket of the binary (LENGTH_BUCKET)
+#define HASHNODE_BUCKET 2 // Nothing - a bucket of leaf slots matched by their leaf fingerprints (BUCKET_FINGERPRINTS)
+#define HASHNODE_COLUMN16 3 // The 16 bit key of the bytes at the node's column and the next column (WIDE_KEY)
+#define HASHNODE_PAIR 4     // The bytes at the node's column and at PAIR_COLUMN combined (PAIR_CHARACTER)
+
+// 16 bit key of a wide node from the bytes at its two columns
+#define WIDE_KEY(first, second) ((unsigned int)(first) << 8 | (unsigned int)(second))
+
+// Character of a pair node from the bytes at its two columns - the second byte has its nibbles swapped so that
+// e.g. two digits (or any two bytes whose high nibbles do not vary) combine without collisions
+#define PAIR_CHARACTER(first, second) ((uint8_t)((first) ^ (uint8_t)((second) << 4 | (second) >> 4)))
+
+// Node layouts - how a node finds the slot for a character (or 16 bit key)
+#define HASHNODE_HASHED 0   // Hash table - hash_function() gives the slot (num_slots 255 is indexed by the character)
+#define HASHNODE_LINEAR 1   // Up to 4 used slots - the slot characters are searched in HASHNODE_KEYS
+#define HASHNODE_SEARCH16 2 // Up to 16 used slots - the slot characters are searched in HASHNODE_KEYS with one compare
+#define HASHNODE_BITMAP 3   // Used slots only - HASHNODE_KEYS is a 256 bit occupancy bitmap, the slot is the bit's rank
+#define HASHNODE_BITMAP16 4 // Wide nodes - as HASHNODE_BITMAP but for 16 bit keys (WideBitmap)
+
+// Bitmap layout keys - 4 words of occupancy bits then the number of bits set in the words before each word
+typedef struct SlotBitmap {
+    uint64_t bits[4];  // Bit (c & 63) of word (c >> 6) is set if character c has a slot
+    uint8_t rank[4];   // Number of bits set in the words before each word
+    uint8_t padding[4];
+} SlotBitmap;
+
+// Wide bitmap layout keys - as SlotBitmap for 16 bit keys, and the number of slots (num_slots only has 8 bits)
+typedef struct WideBitmap {
+    uint64_t bits[1024]; // Bit (k & 63) of word (k >> 6) is set if key k has a slot
+    uint16_t rank[1024]; // Number of bits set in the words before each word
+    uint32_t num_slots;  // Number of slots (not zero based)
+    uint32_t padding;
+} WideBitmap;
+
+// Bytes of keys before the slots of a node for its layout (a multiple of 8 to keep the slots aligned), and their
+// address - the keys are next to the node header so finding a slot touches as few cache lines as possible
+#define HASHNODE_KEYS_SIZE(layout) ((layout) == HASHNODE_LINEAR ? 8 : (layout) == HASHNODE_SEARCH16 ? 16 : \
+                                    (layout) == HASHNODE_BITMAP ? sizeof(SlotBitmap) : \
+                                    (layout) == HASHNODE_BITMAP16 ? sizeof(WideBitmap) : 0)
+#define HASHNODE_KEYS(node) ((uint8_t *)(node)->slot)
+
+// Number of slots of a node (not zero based) - wide nodes can have more than 256
+#define HASHNODE_SLOT_COUNT(node) ((node)->layout == HASHNODE_BITMAP16 ? \
+                                   (size_t)((const WideBitmap *)HASHNODE_KEYS(node))->num_slots : (size_t)(node)->num_slots + 1)
+// Bytes of a node (not including anything after its slots)
+#define HASHNODE_BYTES(node) (sizeof(HashNode) + (node)->keys_size + HASHNODE_SLOT_COUNT(node) * HASHSLOT_SIZE((node)->flags))
+// Second column of a pair node - stored after its slots
+#define PAIR_COLUMN(node) (*(size_t *)HASHNODE_SLOT(node, HASHNODE_SLOT_COUNT(node)))
+
+// Lookup cost model - estimated cycles to find a slot for each layout and what a cycle is worth in node bytes.
+// The builder picks the layout with the lowest bytes + BYTES_PER_LOOKUP_CYCLE * cycles (under a space budget a
+// cycle can be worth nothing - see BuildContext compact)
+#define LOOKUP_CYCLES_HASHED 12   // Multiply and modulo
+#define LOOKUP_CYCLES_NATURAL 1   // 256 slots, the character is the slot
+#define LOOKUP_CYCLES_LINEAR 1    // Per used slot
+#ifdef __SSE2__
+#define LOOKUP_CYCLES_SEARCH16 3  // One 16 byte compare and a bit scan
+#else
+#define LOOKUP_CYCLES_SEARCH16 16 // No SIMD compare, searched like a linear node
+#endif
+#ifdef __POPCNT__
+#define LOOKUP_CYCLES_BITMAP 3    // A bit test and a popcount instruction
+#else
+#define LOOKUP_CYCLES_BITMAP 12   // A bit test and a software popcount
+#endif
+#define BYTES_PER_LOOKUP_CYCLE 8
+// A wide node saves a level for each of its values - a level is a dependent load of the next node
+#define LOOKUP_CYCLES_LEVEL 4
+// Wide nodes are only considered for groups of at least this many values (the bitmap alone is 10K)
+#define WIDE_MIN_VALUES 256
+// Pair nodes are only considered when the best column has at most PAIR_MAX_UNIQUE_CHARS characters and leaves a
+// group of at least PAIR_MIN_OCCURRENCE values, are made from the PAIR_CANDIDATES best columns, and must at least
+// halve the largest group
+#define PAIR_MAX_UNIQUE_CHARS 16
+#define PAIR_MIN_OCCURRENCE 4
+#define PAIR_CANDIDATES 8
+
+// Other columns (those leaving the smallest groups) tried for a node whose subtree is over the depth bound
+#define DEPTH_CANDIDATES 4
+
+// Leaf fingerprints of the slots of a bucket node - one byte per slot, packed into the otherwise unused column
+#define BUCKET_FINGERPRINTS(node) ((uint32_t)(node)->column)
+
+// Length bucket hashed by a length node - lengths from 255 up share the last bucket
+#define LENGTH_BUCKET(length) ((length) < 255 ? (uint8_t)(length) : (uint8_t)255)
+
+// Length held in a leaf slot - LEAF_LENGTH_LONG means the binary is 0xffff bytes or longer
+#define LEAF_LENGTH_LONG 0xffff
+#define LEAF_LENGTH(length) ((length) < LEAF_LENGTH_LONG ? (uint16_t)(length) : (uint16_t)LEAF_LENGTH_LONG)
+
+// Size of a slot - set nodes drop the trailing payload so the slot stride depends on the node flags
+#define HASHSLOT_SIZE(flags) (((flags) & HASHNODE_SET) ? offsetof(HashSlot, payload) : sizeof(HashSlot))
+#define HASHNODE_SIZEFORNUMSLOTS(num_slots, flags) sizeof(HashNode) + (((int)(num_slots) + 1) * HASHSLOT_SIZE(flags))
+// Address of slot i - always use this rather than node->slot[i] as the slot stride and start vary
+#define HASHNODE_SLOT(node, i) ((HashSlot *)((uint8_t *)(node)->slot + (node)->keys_size + (size_t)(i) * HASHSLOT_SIZE((node)->flags)))
 
 // Slot structure for the hash table
 typedef struct HashSlot {
     uint8_t character;     // Character in the slot
+    uint8_t leaf_fingerprint; // Leaf only - leaf_fingerprint() of the binary, checked before the binary is read
+    uint16_t leaf_length;  // Leaf only - LEAF_LENGTH() of the binary, checked before the binary is read
     int count;                               // Number of occurrences of the character (0 for empty slots, 1 for unique characters, >1 for a child node)
     union {
         struct HashNode *child;  // Pointer to child node (for next column)
-        BinaryValue *binary;        // Pointer to binary - this is used to check if the binary is found
+        struct LeafValue *leaf;     // Pointer to the leaf - this is used to check if the binary is found
+        uint32_t fingerprint;       // Fingerprint of the binary (filter nodes only)
     } next_node;
-    Payload payload;                 // Payload for the slot
+    Payload payload;                 // Payload for the slot - must be the last member (not stored for set nodes)
 } HashSlot;
 
+// Leaf structure - the stored binary and the range of its bytes that a lookup still has to compare.
+// The bytes outside the range are at columns on the path to the leaf, which lookup_binary() has already matched
+typedef struct LeafValue {
+    BinaryValue value;     // The binary
+    size_t verify_start;   // First byte to compare
+    size_t verify_end;     // One past the last byte to compare (verify_start == verify_end means nothing to compare)
+} LeafValue;
+
 // Node structure for the tree
 struct HashNode {
-    size_t column;         // Column position
+    size_t column;         // Column position (bucket nodes: BUCKET_FINGERPRINTS)
     uint8_t prime;          // Prime number for hashing
-    uint8_t num_slots;   // Number of slots in the hash table; zero based 0 = 1 slot, 255 = 256 slots
-    HashSlot slot[];       // Slots in the hash table
+    uint8_t num_slots;   // Number of slots in the hash table; zero based 0 = 1 slot, 255 = 256 slots (see HASHNODE_SLOT_COUNT)
+    uint8_t flags;          // Node flags (HASHNODE_SET, HASHNODE_FILTER, HASHNODE_RETRIEVAL)
+    uint8_t fingerprint_bits; // Number of fingerprint bits for filter nodes (8, 16 or 32)
+    uint8_t kind;           // Node kind (HASHNODE_COLUMN, HASHNODE_LENGTH, HASHNODE_BUCKET, HASHNODE_COLUMN16, HASHNODE_PAIR)
+    uint8_t layout;         // Node layout (HASHNODE_HASHED, HASHNODE_LINEAR, HASHNODE_SEARCH16, HASHNODE_BITMAP,
+                            // HASHNODE_BITMAP16)
+    uint16_t keys_size;     // Bytes of keys before the slots (HASHNODE_KEYS_SIZE of the layout)
+    HashSlot slot[];       // Slots in the hash table (after the keys)
 };
 
 /**
@@ -102,446 +298,3193 @@ static uint8_t hash_function(uint8_t character, uint8_t a, uint8_t num_slots) {
 }
 
 /**
- * @brief Calculates the distribution of characters in the given array.
+ * @brief Counts the bits set in a word.
  *
- * This function calculates two distribution values:
- * - The maximum number of occurrences of a single character.
- * - The number of different/unique characters.
- *
- * @param characters Pointer to the array of characters.
- * @param num_chars Number of characters in the array.
- * @param unique_chars Pointer to the variable to store the number of unique characters.
- * @param max_occurrence Pointer to the variable to store the maximum number of occurrences of a single character.
+ * @param word The word.
+ * @return Number of bits set.
  */
-static void calculate_character_distribution(const uint8_t *characters, size_t num_chars, size_t *unique_chars, size_t *max_occurrence) {
-    size_t i;
-    size_t char_counts[256] = {0};
-
-    *max_occurrence = 0;
-
-    // Count occurrences of each character
-    for (i = 0; i < num_chars; i++) {
-        uint8_t c = characters[i];
-        char_counts[c]++;
-        if (char_counts[c] > *max_occurrence) {
-            *max_occurrence = char_counts[c];
-        }
-    }
-
-    // Count the number of unique characters
-    *unique_chars = 0;
-    for (i = 0; i < 256; i++) {
-        if (char_counts[i] > 0) {
-            (*unique_chars)++;
-        }
-    }
+static int popcount64(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
 }
 
-// Work Structure to measure slots used by find_best_hash
-typedef struct SLOT {
-    uint8_t character; // Character in the slot
-    int count;          // Number of occurrences of the character
-} SLOT;
-
 /**
- * @brief Generates the best hash table for the given characters.
+ * @brief Finds the slot for a character (or the 16 bit key of a wide node) in a node.
  *
- * The hash table is stored in a dynamically allocated buffer.
+ * The slot's character must still be checked - a hash table slot can hold a different character.
  *
- * @param characters Pointer to the array of characters.
- * @param num_chars Number of characters in the array.
- * @param best_possible_score The best possible score for the hash table.
- * @param min_unique_chars The minimum number of unique characters.
- * @return Pointer to the root node of the created hash table.
+ * @param node Pointer to the hash node.
+ * @param character The character or key.
+ * @return Pointer to the slot, NULL if the node has no slot for the character.
  */
-static HashNode* find_best_hash(uint8_t *characters, size_t num_chars,  size_t best_possible_score, size_t min_unique_chars) {
-
-    // Prime number list for 'a'
-    uint8_t primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101,
-                    103, 107, 113, 127, 131, 137, 149, 151, 157, 163, 167, 173, 211, 223, 227, 229, 233, 239, 241, 251};
-    int num_primes = sizeof(primes) / sizeof(primes[0]);
-    uint8_t best_a = 0;
-    uint8_t best_m = 0;
-    size_t best_score;
-    SLOT slot_table[256];
-    SLOT best_slot_table[256];
-    int i, j;
-    uint8_t num_slots; // Zero based number of slots
-    HashNode* hash_table;
-
-    best_score = num_chars + 1; // Initialize with a high score
-    num_slots = min_unique_chars - 1; // Initialize with the minimum number of unique characters
-    do {
-        num_slots++;
-        for (i = 0; i < num_primes; i++) {
-            int a = primes[i];
-            // Initialize the slot table
-            for (j = 0; j < num_slots + 1; j++) {
-                slot_table[j].count = 0;
-            }
-
-            size_t differential_score = best_possible_score;
-            int false_positive = 0;
-
-            for (j = 0; j < num_chars; j++) {
-                int slot = hash_function(characters[j], a, num_slots);
-                if (slot_table[slot].count == 0) {
-                    slot_table[slot].character = characters[j];
-                    slot_table[slot].count = 1;
-                } else {
-                    if (slot_table[slot].character != characters[j]) {
-                        false_positive = 1;
-                        break;
-                    } else {
-                        slot_table[slot].count++;
-                        if (slot_table[slot].count > differential_score) {
-                            differential_score = slot_table[slot].count;
-                        }
-                    }
+static HashSlot *node_slot(const HashNode *node, unsigned int character) {
+    const uint8_t *keys;
+    int i;
+    switch (node->layout) {
+        case HASHNODE_LINEAR:
+            keys = HASHNODE_KEYS(node);
+            for (i = 0; i <= node->num_slots; i++) {
+                if (keys[i] == character) {
+                    return HASHNODE_SLOT(node, i);
                 }
             }
-
-            if (!false_positive) {
-                if (differential_score < best_score) {
-                    best_score = differential_score;
-                    best_a = a;
-                    best_m = num_slots;
-                    // Copy with a memcpy
-                    memcpy(best_slot_table, slot_table, sizeof(SLOT) * (best_m + 1));
+            return NULL;
+        case HASHNODE_SEARCH16:
+            keys = HASHNODE_KEYS(node);
+#ifdef __SSE2__
+            {
+                // Compare all 16 keys at once - the bits for the padding past the used slots are masked off
+                __m128i matches = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)keys), _mm_set1_epi8((char)character));
+                unsigned int mask = (unsigned int)_mm_movemask_epi8(matches) & ((2u << node->num_slots) - 1);
+                return mask ? HASHNODE_SLOT(node, __builtin_ctz(mask)) : NULL;
+            }
+#else
+            for (i = 0; i <= node->num_slots; i++) {
+                if (keys[i] == character) {
+                    return HASHNODE_SLOT(node, i);
+                }
+            }
+            return NULL;
+#endif
+        case HASHNODE_BITMAP:
+            {
+                // The slot number is the number of bits set below the character's bit
+                const SlotBitmap *bitmap = (const SlotBitmap *)HASHNODE_KEYS(node);
+                uint64_t word = bitmap->bits[character >> 6];
+                uint64_t bit = (uint64_t)1 << (character & 63);
+                if (!(word & bit)) {
+                    return NULL;
                 }
-                if (best_score == best_possible_score) {
-                    // Found the best possible score
-                    goto found_hash;
+                return HASHNODE_SLOT(node, bitmap->rank[character >> 6] + popcount64(word & (bit - 1)));
+            }
+        case HASHNODE_BITMAP16:
+            {
+                const WideBitmap *bitmap = (const WideBitmap *)HASHNODE_KEYS(node);
+                uint64_t word = bitmap->bits[character >> 6];
+                uint64_t bit = (uint64_t)1 << (character & 63);
+                if (!(word & bit)) {
+                    return NULL;
                 }
+                return HASHNODE_SLOT(node, (size_t)bitmap->rank[character >> 6] + popcount64(word & (bit - 1)));
             }
-        } // end of for loop for 'a'
-    } while (num_slots < 255);  // end of for loop for num_slots
+        default:
+            return HASHNODE_SLOT(node, hash_function((uint8_t)character, node->prime, node->num_slots));
+    }
+}
 
-    found_hash:
+// The bodies of the build kernels are compiled into the kernel of each level (see DEFINE_SIMD_KERNELS)
+#ifdef ACPH_X86_KERNELS
+#define KERNEL_BODY static inline __attribute__((always_inline))
+#else
+#define KERNEL_BODY static
+#endif
 
-    hash_table = (HashNode *)malloc(HASHNODE_SIZEFORNUMSLOTS(best_m));
-    if (hash_table == NULL) {
-        // Handle memory allocation error - our standard is to exit with a PANIC message
-        fprintf(stderr, "PANIC: Memory allocation error\n");
-        exit(1);
-    }
+// Byte histograms are counted into HISTOGRAM_TABLES interleaved 16 bit sub-histograms - consecutive bytes go to
+// different tables, so runs of the same byte do not wait on each other's increment, and the tables stay small in
+// the L1 cache. A block of HISTOGRAM_BLOCK bytes can not overflow a counter; the tables are added up after each block.
+#define HISTOGRAM_TABLES 4
+#define HISTOGRAM_BLOCK ((size_t)HISTOGRAM_TABLES * 65535)
+// Blocks smaller than this are counted into one table (clearing and adding up the others costs more than it saves)
+#define HISTOGRAM_SMALL 512
 
-    hash_table->prime = best_a;
-    hash_table->num_slots = best_m;
-    for (i = 0; i <= hash_table->num_slots; i++) {
-        if (best_slot_table[i].count > 0) {
-            hash_table->slot[i].count = best_slot_table[i].count;
-            hash_table->slot[i].character = best_slot_table[i].character;
-            hash_table->slot[i].payload = (Payload){0};
-            hash_table->slot[i].next_node.child = NULL;
-        } else {
-            hash_table->slot[i].count = 0;
-            hash_table->slot[i].character = 0;
-            hash_table->slot[i].payload = (Payload){0};
-            hash_table->slot[i].next_node.child = NULL;
+/**
+ * @brief Counts the occurrences of each byte of a block of at most HISTOGRAM_BLOCK bytes.
+ *
+ * @param bytes Pointer to the block of bytes.
+ * @param num_bytes Number of bytes (at most HISTOGRAM_BLOCK).
+ * @param counts Set to the number of occurrences of each of the 256 bytes.
+ */
+KERNEL_BODY void histogram_block_body(const uint8_t *bytes, size_t num_bytes, uint32_t *counts) {
+    uint16_t tables[HISTOGRAM_TABLES][256];
+    size_t i = 0;
+    int c;
+
+    if (num_bytes < HISTOGRAM_SMALL) {
+        memset(tables[0], 0, sizeof(tables[0]));
+        for (; i < num_bytes; i++) {
+            tables[0][bytes[i]]++;
+        }
+        for (c = 0; c < 256; c++) {
+            counts[c] = tables[0][c];
         }
+        return;
+    }
+
+    memset(tables, 0, sizeof(tables));
+    for (; i + HISTOGRAM_TABLES <= num_bytes; i += HISTOGRAM_TABLES) {
+        tables[0][bytes[i]]++;
+        tables[1][bytes[i + 1]]++;
+        tables[2][bytes[i + 2]]++;
+        tables[3][bytes[i + 3]]++;
+    }
+    // The last bytes go on round the tables too (a block of one byte must not overflow the first table)
+    for (; i < num_bytes; i++) {
+        tables[i % HISTOGRAM_TABLES][bytes[i]]++;
     }
+    // Add the tables up (vectorised by the compiler for the level's instruction set)
+    for (c = 0; c < 256; c++) {
+        counts[c] = (uint32_t)tables[0][c] + tables[1][c] + tables[2][c] + tables[3][c];
+    }
+}
+
+/**
+ * @brief Counts the occurrences of each byte of an array (the body of the count_bytes kernels).
+ *
+ * @param bytes Pointer to the array of bytes.
+ * @param num_bytes Number of bytes.
+ * @param counts Set to the number of occurrences of each of the 256 bytes.
+ */
+KERNEL_BODY void count_bytes_body(const uint8_t *bytes, size_t num_bytes, size_t *counts) {
+    uint32_t block_counts[256];
+    size_t start, block;
+    int c;
 
-    return hash_table;
+    memset(counts, 0, 256 * sizeof(size_t));
+    for (start = 0; start < num_bytes; start += block) {
+        block = num_bytes - start < HISTOGRAM_BLOCK ? num_bytes - start : HISTOGRAM_BLOCK;
+        histogram_block_body(bytes + start, block, block_counts);
+        for (c = 0; c < 256; c++) {
+            counts[c] += block_counts[c];
+        }
+    }
 }
 
 /**
- * @brief Builds a hash table for characters/bytes provided as a binary & length.
+ * @brief Calculates the distribution of characters in the given array (the body of the distribution kernels).
  *
- * This function returns the best (smallest) hash table for the given characters.
+ * The characters are counted in one pass (see histogram_block_body()) and the unique characters and the maximum
+ * occurrence are then found in one branch free pass over the 256 counts, which the compiler vectorises.
  *
  * @param characters Pointer to the array of characters.
- * @param payloads Pointer to the array of payloads.
  * @param num_chars Number of characters in the array.
- * @return Pointer to the root node of the created hash table.
+ * @param unique_chars Pointer to the variable to store the number of unique characters.
+ * @param max_occurrence Pointer to the variable to store the maximum number of occurrences of a single character.
  */
-HashNode* create_character_hash(uint8_t *characters, Payload *payloads, size_t num_chars) {
-    size_t best_possible_score;
-    size_t min_unique_chars;
-    HashNode *node;
-    size_t i;
+KERNEL_BODY void distribution_body(const uint8_t *characters, size_t num_chars, size_t *unique_chars, size_t *max_occurrence) {
+    int c;
 
-    calculate_character_distribution(characters, num_chars, &min_unique_chars, &best_possible_score);
+    if (num_chars <= HISTOGRAM_BLOCK) {
+        // The usual case - the counts fit 32 bits, so twice as many are compared per instruction
+        uint32_t counts[256];
+        uint32_t unique = 0, max = 0;
+        histogram_block_body(characters, num_chars, counts);
+        for (c = 0; c < 256; c++) {
+            unique += counts[c] != 0;
+            max = counts[c] > max ? counts[c] : max;
+        }
+        *unique_chars = unique;
+        *max_occurrence = max;
+    } else {
+        size_t counts[256];
+        size_t unique = 0, max = 0;
+        count_bytes_body(characters, num_chars, counts);
+        for (c = 0; c < 256; c++) {
+            unique += counts[c] != 0;
+            max = counts[c] > max ? counts[c] : max;
+        }
+        *unique_chars = unique;
+        *max_occurrence = max;
+    }
+}
 
-    node = find_best_hash(characters, num_chars, best_possible_score, min_unique_chars);
+// The build kernels of an instruction set level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512)
+typedef struct SimdKernels {
+    void (*count_bytes)(const uint8_t *bytes, size_t num_bytes, size_t *counts);
+    void (*distribution)(const uint8_t *characters, size_t num_chars, size_t *unique_chars, size_t *max_occurrence);
+} SimdKernels;
 
-    // For a character hash it is always perfect so any counts > 1 just means duplicate inputs - we set count to 1
-    // Note the binary hash will need to know the counts > 1, which is why we clear them here and not in find_best_hash()
-    for (i = 0; i <= node->num_slots; i++) {
-        if (node->slot[i].count > 1) {
-            node->slot[i].count = 1;
-        }
+// Defines the kernels of a level - the bodies compiled for the level's instruction set
+#define DEFINE_SIMD_KERNELS(suffix, target) \
+    target static void count_bytes_##suffix(const uint8_t *bytes, size_t num_bytes, size_t *counts) { \
+        count_bytes_body(bytes, num_bytes, counts); \
+    } \
+    target static void distribution_##suffix(const uint8_t *characters, size_t num_chars, size_t *unique_chars, \
+                                             size_t *max_occurrence) { \
+        distribution_body(characters, num_chars, unique_chars, max_occurrence); \
     }
 
-    // We need to set the payload for the slot
-    // Loop through the characters, find the slot and set the payload
-    for (i = 0; i < num_chars; i++) {
-        int slot = hash_function(characters[i], node->prime, node->num_slots);
-        if (node->slot[slot].count == 1 && node->slot[slot].character == characters[i]) {
-            node->slot[slot].payload = payloads[i];
-        }
+DEFINE_SIMD_KERNELS(scalar, )
+#ifdef ACPH_X86_KERNELS
+DEFINE_SIMD_KERNELS(sse42, __attribute__((target("sse4.2,popcnt"))))
+DEFINE_SIMD_KERNELS(avx2, __attribute__((target("avx2,popcnt"))))
+DEFINE_SIMD_KERNELS(avx512, __attribute__((target("avx512f,avx512bw,popcnt"))))
+#endif
+
+// The kernels of each level (levels the compiler can not target use the scalar kernels)
+static const SimdKernels level_kernels[ACPH_SIMD_AVX512 + 1] = {
+    {count_bytes_scalar, distribution_scalar},
+#ifdef ACPH_X86_KERNELS
+    {count_bytes_sse42, distribution_sse42},
+    {count_bytes_avx2, distribution_avx2},
+    {count_bytes_avx512, distribution_avx512}
+#else
+    {count_bytes_scalar, distribution_scalar},
+    {count_bytes_scalar, distribution_scalar},
+    {count_bytes_scalar, distribution_scalar}
+#endif
+};
+
+// The level in use and its kernels - set at startup to the best level of the CPU, see force_simd_level()
+static int simd_level_used = ACPH_SIMD_SCALAR;
+static const SimdKernels *simd_kernels = &level_kernels[ACPH_SIMD_SCALAR];
+
+/**
+ * @brief Finds the best instruction set level of the CPU (and the compiler).
+ *
+ * @return The level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512).
+ */
+static int detect_simd_level(void) {
+#ifdef ACPH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+        return ACPH_SIMD_AVX512;
     }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return ACPH_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return ACPH_SIMD_SSE42;
+    }
+#endif
+    return ACPH_SIMD_SCALAR;
+}
 
-    return node;
+#ifdef ACPH_X86_KERNELS
+/**
+ * @brief Picks the kernels for the CPU when the library is loaded.
+ */
+__attribute__((constructor)) static void init_simd_kernels(void) {
+    force_simd_level(ACPH_SIMD_AUTO);
 }
+#endif
 
 /**
- * @brief Looks up a character in the hash node.
+ * @brief Returns the instruction set level of the build kernels in use.
  *
- * This function returns the slot index if the character is found, -1 otherwise.
+ * @return The level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512).
+ */
+int simd_level(void) {
+    return simd_level_used;
+}
+
+/**
+ * @brief Forces the build kernels to an instruction set level (e.g. to benchmark them).
  *
- * @param character The character to look up.
- * @param node Pointer to the hash node.
- * @param payload_out Pointer to the variable to store the payload if the character is found.
- * @return The slot index if the character is found, -1 otherwise.
+ * @param level The level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512), or ACPH_SIMD_AUTO for the best level of the CPU.
+ * @return 1 if the level is used, 0 if the CPU (or the compiler) does not support it.
  */
-int lookup_character(uint8_t character, const HashNode *node, Payload *payload_out) {
-    int slot = hash_function(character, node->prime, node->num_slots);
-    if (node->slot[slot].count > 0 && node->slot[slot].character == character) {
-        if (payload_out != NULL) {
-            *payload_out = node->slot[slot].payload;
-        }
-        return 1;
+int force_simd_level(int level) {
+    int best = detect_simd_level();
+    if (level == ACPH_SIMD_AUTO) {
+        level = best;
     }
-    return 0;
+    if (level < ACPH_SIMD_SCALAR || level > best) {
+        return 0;
+    }
+    simd_level_used = level;
+    simd_kernels = &level_kernels[level];
+    return 1;
 }
 
 /**
- * @brief Builds the tree structure recursively from a set of binary buffers.
+ * @brief Calculates the distribution of characters in the given array.
  *
- * This function creates the tree structure for the given binary values and payloads.
+ * This function calculates two distribution values:
+ * - The maximum number of occurrences of a single character.
+ * - The number of different/unique characters.
  *
- * @param values Pointer to the array of binary values.
- * @param payloads Pointer to the array of payloads.
- * @param num_values Number of binary values.
- * @return Pointer to the root node of the created hash table.
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters in the array.
+ * @param unique_chars Pointer to the variable to store the number of unique characters.
+ * @param max_occurrence Pointer to the variable to store the maximum number of occurrences of a single character.
  */
-HashNode *create_binary_hash(BinaryValue *values, Payload *payloads, size_t num_values) { // NOLINT
-    if (num_values < 1) {
-        return NULL; // No values to process
-    }
+static void calculate_character_distribution(const uint8_t *characters, size_t num_chars, size_t *unique_chars, size_t *max_occurrence) {
+    simd_kernels->distribution(characters, num_chars, unique_chars, max_occurrence);
+}
 
-    // Find the best column with the lowest 'num_slots' values
-    uint8_t *column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
-    if (column_chars == NULL) {
-        // Handle memory allocation error - our standard is to exit with a PANIC message
-        fprintf(stderr, "PANIC: Memory allocation error\n");
-        exit(1);
-    }
-    uint8_t *best_column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
-    if (best_column_chars == NULL) {
-        // Handle memory allocation error - our standard is to exit with a PANIC message
-        fprintf(stderr, "PANIC: Memory allocation error\n");
-        exit(1);
-    }
-    size_t best_column = 0;
-    size_t best_num_slots = num_values + 1; // Initialize with a high value
-    size_t num_slots;
-    size_t unique_chars, best_unique_chars;
-    int c;
-    size_t i, j;
-    size_t last_column = 0;
-    for (c = 0; !last_column; c++) {
-        // Extract characters from the current column
-        last_column = 1;
-        uint8_t character;
-        for (i = 0; i < num_values; i++) {
-            if (values[i].length > c) {
-                last_column = 0;
-                character = values[i].binary[c];
-            }
-            else {
-                character = 0;
-            }
-            column_chars[i] = character;
-        }
-        calculate_character_distribution(column_chars, num_values, &unique_chars, &num_slots);
-        if (num_slots < best_num_slots) {
-            best_column = c;
-            best_num_slots = num_slots;
-            best_unique_chars = unique_chars;
-            memcpy(best_column_chars, column_chars, num_values * sizeof(uint8_t));
-        }
-    }
-    free(column_chars);
+// Progress of a build - shared by every node of the tree through BuildContext progress
+typedef struct BuildProgress {
+    build_progress_func callback; // Called with the counts as the build goes on (NULL for none)
+    void *data;                   // Passed to the callback
+    volatile int *cancel;         // The build is cancelled once this is set non-zero (NULL for none)
+    size_t keys_placed;           // Keys in leaf slots of the tree so far
+    size_t nodes_created;         // Nodes of the tree so far
+    size_t next_report;           // The callback is called again once keys_placed reaches this
+} BuildProgress;
 
-    if (best_unique_chars == 1 && num_values > 1) {
-        // All the characters in the best column are the same - so there must be a duplicate
-        // Return NULL to signal the duplicate - which is an input error
-        return NULL;
-    }
+// A child group that a node tried under a depth bound could not be built in the levels it had left - the other
+// nodes tried for the parent group skip a column that would keep it together (see build_bounded_node())
+typedef struct DepthFailure {
+    BinaryValue *values; // The binaries of the group (NULL for none yet)
+    size_t num_values;   // Number of binaries
+    size_t levels;       // Levels the group had left
+} DepthFailure;
 
-    // Create a new node for the best column
-    HashNode *node = find_best_hash(best_column_chars, num_values, best_num_slots, best_unique_chars);
-    node->column = best_column;
+// Build settings shared by every node of a tree (except levels, which is one less for each level down)
+typedef struct BuildContext {
+    uint8_t flags;            // Node flags (HASHNODE_SET, HASHNODE_FILTER, HASHNODE_RETRIEVAL)
+    uint8_t fingerprint_bits; // Number of fingerprint bits for filter trees (8, 16 or 32)
+    int length_dispatch;      // Non-zero to start the tree with a length node
+    uint8_t bucket_size;      // Groups of up to this many binaries go in a bucket node (0 for no buckets)
+    int wide_columns;         // Non-zero to allow wide (HASHNODE_COLUMN16) nodes
+    uint8_t column_scoring;   // Column scoring policy (ACPH_SCORE_MAX_OCCURRENCE, ACPH_SCORE_ENTROPY, ACPH_SCORE_SUM_OF_SQUARES)
+    uint8_t beam_width;       // Number of best scoring columns tried by building the subtrees below them (0 or 1 for none)
+    const double *weights;    // Access weight of each binary given to the root (NULL for equal weights)
+    size_t levels;            // Levels of nodes left for the subtree under a depth bound (0 for no bound)
+    size_t max_bytes;         // Space budget for the tree in bytes, see hash_table_bytes() (0 for none)
+    int compact;              // Non-zero for the smallest nodes rather than the fastest (to meet a space budget)
+    uint8_t effort;           // Build effort (ACPH_EFFORT_BALANCED, ACPH_EFFORT_FAST, ACPH_EFFORT_THOROUGH)
+    double deadline;          // build_clock() time after which the builder stops searching (0 for no time budget)
+    BuildProgress *progress;  // Progress callback and cancel flag of the build (NULL for neither)
+    uint8_t threads;          // Threads for large nodes (0 or 1 for none)
+    size_t parallel_threshold; // Nodes of at least this many binaries are built on the threads
+    DepthFailure *depth_failure; // Set to a child group over the depth bound by build_slots() (NULL to not record)
+} BuildContext;
 
-    // Process values by hash values and create child nodes recursively
-    for (i = 0; i <= node->num_slots; i++) {
-        if (node->slot[i].count == 0) {
-            node->slot[i].next_node.child = NULL;
-        }
-        else if (node->slot[i].count == 1) {
-            int found = 0;
-            // Find the binary that hashes to this slot
-            for (j = 0; j < num_values; j++) {
-                uint8_t character;
-                if (node->column >= values[j].length) {
-                    character = 0;
-                }
-                else {
-                    character = (uint8_t) values[j].binary[node->column];
-                }
+// What a lookup cycle is worth in node bytes for a build
+#define CTX_BYTES_PER_CYCLE(ctx) ((ctx)->compact ? 0 : BYTES_PER_LOOKUP_CYCLE)
 
-                if (character == node->slot[i].character) {
-                    // Found the binary that hashes to this slot
-                    found = 1;
-                    node->slot[i].next_node.binary = malloc(sizeof(BinaryValue));
-                    if (node->slot[i].next_node.binary == NULL) {
-                        // Handle memory allocation error - our standard is to exit with a PANIC message
-                        fprintf(stderr, "PANIC: Memory allocation error\n");
-                        exit(1);
-                    }
-                    memcpy(node->slot[i].next_node.binary, &values[j], sizeof(BinaryValue));
-                    // Set the payload
-                    node->slot[i].payload = payloads[j];
-                    break;
-                }
-            }
-            if (!found) {
-                // Panic the binary is not found
-                fprintf(stderr, "PANIC: Binary not found\n");
-                exit(1);
-            }
-        }
-        else if (node->slot[i].count > 0) {
-            // Create a list of values that hash to this slot
-            BinaryValue *grouped_strings = (BinaryValue *)malloc(node->slot[i].count * sizeof(BinaryValue));
-            if (grouped_strings == NULL) {
-                // Handle memory allocation error - our standard is to exit with a PANIC message
-                fprintf(stderr, "PANIC: Memory allocation error\n");
-                exit(1);
-            }
-            // Create a list of payloads that hash to this slot
-            Payload *grouped_payloads = (Payload *)malloc(node->slot[i].count * sizeof(Payload));
-            if (grouped_payloads == NULL) {
-                // Handle memory allocation error - our standard is to exit with a PANIC message
-                fprintf(stderr, "PANIC: Memory allocation error\n");
-                exit(1);
-            }
-            int count = 0;
-            for (j = 0; j < num_values; j++) {
-                if ((uint8_t)values[j].binary[node->column] == node->slot[i].character) {
-                    grouped_strings[count] = values[j];
-                    grouped_payloads[count++] = payloads[j];
-                }
-            }
+// Beam width for ACPH_EFFORT_THOROUGH builds that do not set one
+#define THOROUGH_BEAM_WIDTH 4
 
-            // Recursively build the child node for this group
-            node->slot[i].next_node.child = create_binary_hash(grouped_strings, grouped_payloads,count);
-            free(grouped_strings);
+// Values a column is scored on in the large groups of fast builds (see build_binary_node())
+#define SAMPLE_VALUES 1024
 
-            if (node->slot[i].next_node.child == NULL) {
-                // NULL - means a duplicate has been found - an input error
-                // Free any mallocs and return NULL
-                free(grouped_payloads);
-                for (j = 0; j <= i; j++) {
-                    if (node->slot[j].count == 1) {
-                        if (node->slot[j].next_node.binary) free(node->slot[j].next_node.binary);
-                    }
-                }
-                free(node);
-                return NULL;
-            }
+// Keys placed between calls of a build's progress callback
+#define PROGRESS_INTERVAL 16384
 
-        }
-    }
+/**
+ * @brief Returns a wall clock time in seconds (for build time budgets).
+ *
+ * @return The time in seconds from an arbitrary start.
+ */
+static double build_clock(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
 
-    free(best_column_chars);
-    return node;
+/**
+ * @brief Checks if the time budget of a build is spent.
+ *
+ * @param ctx Build settings.
+ * @return 1 if the time budget is spent, 0 otherwise (or if there is no time budget).
+ */
+static int build_expired(const BuildContext *ctx) {
+    return ctx->deadline > 0 && build_clock() > ctx->deadline;
 }
 
 /**
- * @brief Compares two binary values.
+ * @brief Checks if a build has been cancelled (HashBuildOptions cancel).
  *
- * This function compares two binary values and returns 1 if they are equal, 0 otherwise.
+ * @param ctx Build settings.
+ * @return 1 if the build has been cancelled, 0 otherwise.
+ */
+static int build_cancelled(const BuildContext *ctx) {
+    return ctx->progress != NULL && ctx->progress->cancel != NULL && *ctx->progress->cancel;
+}
+
+/**
+ * @brief Counts keys and nodes added to the tree of a build and calls its progress callback when due.
  *
- * @param str1 Pointer to the first binary value.
- * @param str2 Pointer to the second binary value.
- * @return 1 if the binary values are equal, 0 otherwise.
+ * @param ctx Build settings.
+ * @param keys Number of keys placed in leaf slots.
+ * @param nodes Number of nodes created.
  */
-int compare_binaries(const BinaryValue *str1, const BinaryValue *str2) {
-    if (str1->length != str2->length) {
-        return 0;
+static void build_placed(const BuildContext *ctx, size_t keys, size_t nodes) {
+    BuildProgress *progress = ctx->progress;
+    if (progress == NULL) {
+        return;
+    }
+    progress->keys_placed += keys;
+    progress->nodes_created += nodes;
+    if (progress->callback != NULL && progress->keys_placed >= progress->next_report) {
+        progress->callback(progress->keys_placed, progress->nodes_created, progress->data);
+        progress->next_report = progress->keys_placed + PROGRESS_INTERVAL;
     }
-    return memcmp(str1->binary, str2->binary, str1->length) == 0;
 }
 
 /**
- * @brief Compares a binary against the tree structure.
- *
- * This function looks up a binary value in the hash node and returns 1 if found (and sets payload), 0 otherwise.
+ * @brief Counts the keys in leaf slots and the nodes of a tree being built.
  *
- * @param str Pointer to the binary value to compare.
- * @param node Pointer to the root node of the hash table.
- * @param payload_out Pointer to the payload to be set if the binary is found.
- * @return 1 if found (and sets payload), 0 otherwise.
+ * @param node Pointer to the root node of the tree.
+ * @param keys Incremented by the number of keys.
+ * @param nodes Incremented by the number of nodes.
+ */
+static void count_built(const HashNode *node, size_t *keys, size_t *nodes) { // NOLINT
+    size_t i;
+    (*nodes)++;
+    for (i = 0; i < HASHNODE_SLOT_COUNT(node); i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
+        if (slot->count == 1) {
+            (*keys)++;
+        }
+        else if (slot->count > 1) {
+            count_built(slot->next_node.child, keys, nodes);
+        }
+    }
+}
+
+// A part of the work of a node run by run_parallel() - the parts are independent
+typedef void (*parallel_func)(void *arg, size_t part, size_t num_parts);
+
+// The arguments of a part run on a thread
+typedef struct ParallelPart {
+    parallel_func func;
+    void *arg;
+    size_t part;
+    size_t num_parts;
+} ParallelPart;
+
+#ifdef ACPH_THREADS
+/**
+ * @brief Thread start routine for run_parallel().
+ *
+ * @param arg Pointer to the ParallelPart.
+ * @return NULL.
+ */
+static void *run_parallel_part(void *arg) {
+    ParallelPart *part = (ParallelPart *)arg;
+    part->func(part->arg, part->part, part->num_parts);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Runs the parts of a piece of work, each on its own thread (the first on the calling thread), and waits
+ * for them all.
+ *
+ * Without ACPH_THREADS (or if a thread can not be started) the parts run one after another on the calling thread.
+ *
+ * @param func The function run for each part.
+ * @param arg Argument passed to each part.
+ * @param num_parts Number of parts (up to ACPH_MAX_THREADS).
+ */
+static void run_parallel(parallel_func func, void *arg, size_t num_parts) {
+    size_t i;
+#ifdef ACPH_THREADS
+    pthread_t threads[ACPH_MAX_THREADS];
+    ParallelPart parts[ACPH_MAX_THREADS];
+    int started[ACPH_MAX_THREADS];
+
+    for (i = 1; i < num_parts; i++) {
+        parts[i].func = func;
+        parts[i].arg = arg;
+        parts[i].part = i;
+        parts[i].num_parts = num_parts;
+        started[i] = pthread_create(&threads[i], NULL, run_parallel_part, &parts[i]) == 0;
+        if (!started[i]) {
+            func(arg, i, num_parts);
+        }
+    }
+    func(arg, 0, num_parts);
+    for (i = 1; i < num_parts; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+#else
+    for (i = 0; i < num_parts; i++) {
+        func(arg, i, num_parts);
+    }
+#endif
+}
+
+/**
+ * @brief Returns the number of parts the work of a node is split into - one part per thread for large nodes.
+ *
+ * @param ctx Build settings.
+ * @param num_values Number of binaries in the node.
+ * @param max_parts The most parts the work can be split into.
+ * @return The number of parts (1 to run on the calling thread alone).
+ */
+static size_t build_parts(const BuildContext *ctx, size_t num_values, size_t max_parts) {
+    size_t parts = ctx->threads;
+    if (parts < 2 || num_values < ctx->parallel_threshold) {
+        return 1;
+    }
+    return parts < max_parts ? parts : (max_parts ? max_parts : 1);
+}
+
+/**
+ * @brief Frees a tree (or subtree) the builder does not keep and takes it off the build's progress counts.
+ *
+ * @param ctx Build settings.
+ * @param node Pointer to the root node of the tree.
+ */
+static void discard_tree(const BuildContext *ctx, HashNode *node) {
+    if (ctx->progress != NULL && node != NULL) {
+        size_t keys = 0, nodes = 0;
+        count_built(node, &keys, &nodes);
+        ctx->progress->keys_placed -= keys;
+        ctx->progress->nodes_created -= nodes;
+    }
+    free_tree(node);
+}
+
+/**
+ * @brief Scores the characters of a column - the column with the lowest score is used for a node.
+ *
+ * Each score estimates how much work is left below the node:
+ * - ACPH_SCORE_MAX_OCCURRENCE: The size of the largest group.
+ * - ACPH_SCORE_ENTROPY: The sum of count * log2(count) over the groups - the bits still needed to tell the
+ *   values apart (the number of values times the log2 of their number, less their Shannon entropy).
+ * - ACPH_SCORE_SUM_OF_SQUARES: The sum of the squared group sizes - the number of values times the expected size
+ *   of the group a value falls in.
+ *
+ * With access weights each group counts by its weight rather than its number of values, so the score is of the
+ * lookups rather than the values: the entropy score is the sum of weight * log2(count), and the other policies
+ * use the sum of weight * count (the largest group says nothing about where the weight is). Columns that leave
+ * the heavy values alone in their slots, as leaves at this level, score best.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param weights Access weight of each character's value (NULL for equal weights).
+ * @param num_chars Number of characters in the array.
+ * @param column_scoring Column scoring policy.
+ * @param unique_chars Pointer to the variable to store the number of unique characters.
+ * @param max_occurrence Pointer to the variable to store the maximum number of occurrences of a single character.
+ * @return The score of the column.
+ */
+static double score_column(const uint8_t *characters, const double *weights, size_t num_chars, uint8_t column_scoring, size_t *unique_chars, size_t *max_occurrence) {
+    size_t i;
+    size_t char_counts[256];
+    double char_weights[256];
+    double score = 0;
+
+    if (weights == NULL && column_scoring == ACPH_SCORE_MAX_OCCURRENCE) {
+        // The largest group is the score - the distribution kernel finds it
+        calculate_character_distribution(characters, num_chars, unique_chars, max_occurrence);
+        return (double)*max_occurrence;
+    }
+
+    *max_occurrence = 0;
+    *unique_chars = 0;
+
+    // Count occurrences of each character (the largest group is found with the groups below)
+    simd_kernels->count_bytes(characters, num_chars, char_counts);
+
+    if (weights != NULL) {
+        // Weighted - the score of the lookups
+        memset(char_weights, 0, sizeof(char_weights));
+        for (i = 0; i < num_chars; i++) {
+            char_weights[characters[i]] += weights[i];
+        }
+        for (i = 0; i < 256; i++) {
+            if (char_counts[i] > 0) {
+                (*unique_chars)++;
+                if (char_counts[i] > *max_occurrence) {
+                    *max_occurrence = char_counts[i];
+                }
+                if (column_scoring == ACPH_SCORE_ENTROPY) {
+                    score += char_weights[i] * log((double)char_counts[i]) / log(2.0);
+                }
+                else {
+                    score += char_weights[i] * (double)char_counts[i];
+                }
+            }
+        }
+        return score;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (char_counts[i] > 0) {
+            (*unique_chars)++;
+            if (char_counts[i] > *max_occurrence) {
+                *max_occurrence = char_counts[i];
+            }
+            if (column_scoring == ACPH_SCORE_ENTROPY && char_counts[i] > 1) {
+                score += (double)char_counts[i] * log((double)char_counts[i]) / log(2.0);
+            }
+            else if (column_scoring == ACPH_SCORE_SUM_OF_SQUARES) {
+                score += (double)char_counts[i] * (double)char_counts[i];
+            }
+        }
+    }
+    return score;
+}
+
+// Column matched on the path from the root to a node - a linked list on the builder's stack
+typedef struct PathColumn {
+    size_t column;                  // Column of an ancestor node
+    const struct PathColumn *parent; // Column of the ancestor's parent (NULL at the root)
+} PathColumn;
+
+// Work Structure to measure slots used by find_best_hash
+typedef struct SLOT {
+    uint8_t character; // Character in the slot
+    int count;          // Number of occurrences of the character
+} SLOT;
+
+/**
+ * @brief Chooses the layout of a node with the lookup cost model.
+ *
+ * @param used Number of used slots.
+ * @param num_slots Number of slots of the hash table (zero based).
+ * @param flags Node flags (HASHNODE_SET) - these determine the slot size.
+ * @param bytes_per_cycle What a lookup cycle is worth in bytes (BYTES_PER_LOOKUP_CYCLE, or 0 for the smallest).
+ * @return The layout with the lowest cost.
+ */
+static uint8_t choose_layout(size_t used, uint8_t num_slots, uint8_t flags, size_t bytes_per_cycle) {
+    size_t slot_size = HASHSLOT_SIZE(flags);
+    size_t cost, best_cost;
+    uint8_t best_layout = HASHNODE_HASHED;
+
+    if (used == 0) {
+        return HASHNODE_HASHED; // An empty node (no characters) keeps its one empty slot
+    }
+    best_cost = ((size_t)num_slots + 1) * slot_size +
+                bytes_per_cycle * (num_slots == 255 ? LOOKUP_CYCLES_NATURAL : LOOKUP_CYCLES_HASHED);
+    if (used <= 4) {
+        cost = used * slot_size + HASHNODE_KEYS_SIZE(HASHNODE_LINEAR) + bytes_per_cycle * LOOKUP_CYCLES_LINEAR * used;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_layout = HASHNODE_LINEAR;
+        }
+    }
+    if (used <= 16) {
+        cost = used * slot_size + HASHNODE_KEYS_SIZE(HASHNODE_SEARCH16) + bytes_per_cycle * LOOKUP_CYCLES_SEARCH16;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_layout = HASHNODE_SEARCH16;
+        }
+    }
+    cost = used * slot_size + HASHNODE_KEYS_SIZE(HASHNODE_BITMAP) + bytes_per_cycle * LOOKUP_CYCLES_BITMAP;
+    if (cost < best_cost) {
+        best_layout = HASHNODE_BITMAP;
+    }
+    return best_layout;
+}
+
+/**
+ * @brief Creates a node from a slot table found by find_best_hash.
+ *
+ * The node is laid out as a hash table or, if the cost model prefers it, with only the used slots (in character
+ * order) after the keys to find them (HASHNODE_KEYS).
+ *
+ * @param slot_table The slot table.
+ * @param prime The prime number for hashing.
+ * @param num_slots Number of slots of the slot table (zero based).
+ * @param flags Node flags (HASHNODE_SET) - these determine the slot layout.
+ * @param bytes_per_cycle What a lookup cycle is worth in bytes (see choose_layout()).
+ * @return Pointer to the new node.
+ */
+static HashNode *create_node(const SLOT *slot_table, uint8_t prime, uint8_t num_slots, uint8_t flags, size_t bytes_per_cycle) {
+    size_t used = 0;
+    int i, c;
+    uint8_t layout;
+    HashNode *node;
+
+    for (i = 0; i <= num_slots; i++) {
+        if (slot_table[i].count > 0) {
+            used++;
+        }
+    }
+    layout = choose_layout(used, num_slots, flags, bytes_per_cycle);
+    uint8_t node_slots = layout == HASHNODE_HASHED ? num_slots : (uint8_t)(used - 1);
+
+    node = (HashNode *)malloc(HASHNODE_SIZEFORNUMSLOTS(node_slots, flags) + HASHNODE_KEYS_SIZE(layout));
+    if (node == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+
+    node->column = 0;
+    node->prime = prime;
+    node->num_slots = node_slots;
+    node->flags = flags;
+    node->fingerprint_bits = 0;
+    node->kind = HASHNODE_COLUMN;
+    node->layout = layout;
+    node->keys_size = HASHNODE_KEYS_SIZE(layout);
+    for (i = 0; i <= node_slots; i++) {
+        HashSlot *slot = HASHNODE_SLOT(node, i);
+        slot->count = 0;
+        slot->character = 0;
+        slot->leaf_fingerprint = 0;
+        slot->leaf_length = 0;
+        slot->next_node.child = NULL;
+        if (!(flags & HASHNODE_SET)) {
+            slot->payload = (Payload){0};
+        }
+    }
+
+    if (layout == HASHNODE_HASHED) {
+        for (i = 0; i <= num_slots; i++) {
+            if (slot_table[i].count > 0) {
+                HASHNODE_SLOT(node, i)->count = slot_table[i].count;
+                HASHNODE_SLOT(node, i)->character = slot_table[i].character;
+            }
+        }
+        return node;
+    }
+
+    // Compact layouts - the used slots in character order, and the keys to find them
+    int table_slot[256];
+    uint8_t *keys = HASHNODE_KEYS(node);
+    memset(keys, 0, HASHNODE_KEYS_SIZE(layout));
+    for (c = 0; c < 256; c++) {
+        table_slot[c] = -1;
+    }
+    for (i = 0; i <= num_slots; i++) {
+        if (slot_table[i].count > 0) {
+            table_slot[slot_table[i].character] = i;
+        }
+    }
+    i = 0;
+    for (c = 0; c < 256; c++) {
+        if (table_slot[c] >= 0) {
+            HASHNODE_SLOT(node, i)->count = slot_table[table_slot[c]].count;
+            HASHNODE_SLOT(node, i)->character = (uint8_t)c;
+            if (layout == HASHNODE_BITMAP) {
+                ((SlotBitmap *)keys)->bits[c >> 6] |= (uint64_t)1 << (c & 63);
+            }
+            else {
+                keys[i] = (uint8_t)c;
+            }
+            i++;
+        }
+    }
+    if (layout == HASHNODE_BITMAP) {
+        SlotBitmap *bitmap = (SlotBitmap *)keys;
+        for (c = 1; c < 4; c++) {
+            bitmap->rank[c] = (uint8_t)(bitmap->rank[c - 1] + popcount64(bitmap->bits[c - 1]));
+        }
+    }
+    return node;
+}
+
+// Primes for the 'a' of hash_function() - tried in this order for each table size
+static const uint8_t hash_primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83,
+                                      89, 97, 101, 103, 107, 113, 127, 131, 137, 149, 151, 157, 163, 167, 173, 211, 223,
+                                      227, 229, 233, 239, 241, 251};
+#define NUM_HASH_PRIMES (sizeof(hash_primes) / sizeof(hash_primes[0]))
+
+// The characters of a node counted by count_characters() - split over threads for large nodes
+typedef struct CharacterCount {
+    const uint8_t *characters; // The characters
+    size_t num_chars;          // Number of characters
+    size_t *counts;            // 256 counts for each part
+} CharacterCount;
+
+/**
+ * @brief Counts one part (a range) of the characters of a node (see run_parallel()).
+ *
+ * @param arg Pointer to the CharacterCount.
+ * @param part The part to count.
+ * @param num_parts Number of parts.
+ */
+static void count_characters_part(void *arg, size_t part, size_t num_parts) {
+    CharacterCount *count = (CharacterCount *)arg;
+    size_t *counts = count->counts + part * 256;
+    size_t start = count->num_chars * part / num_parts;
+    size_t end = count->num_chars * (part + 1) / num_parts;
+
+    simd_kernels->count_bytes(count->characters + start, end - start, counts);
+}
+
+/**
+ * @brief Counts the occurrences of each character, split over the build's threads for large nodes.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters.
+ * @param ctx Build settings (threads).
+ * @param counts Set to the number of occurrences of each of the 256 characters.
+ */
+static void count_characters(const uint8_t *characters, size_t num_chars, const BuildContext *ctx, size_t *counts) {
+    size_t num_parts = build_parts(ctx, num_chars, ACPH_MAX_THREADS);
+    size_t part, c;
+    CharacterCount count;
+
+    count.characters = characters;
+    count.num_chars = num_chars;
+    count.counts = counts;
+    if (num_parts > 1) {
+        count.counts = (size_t *)malloc(num_parts * 256 * sizeof(size_t));
+        if (count.counts == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+    }
+    run_parallel(count_characters_part, &count, num_parts);
+    if (num_parts > 1) {
+        for (c = 0; c < 256; c++) {
+            counts[c] = 0;
+            for (part = 0; part < num_parts; part++) {
+                counts[c] += count.counts[part * 256 + c];
+            }
+        }
+        free(count.counts);
+    }
+}
+
+/**
+ * @brief Finds the first of hash_primes that puts each of the distinct characters in its own slot.
+ *
+ * Most primes collide within the first few characters, so each is dropped early.
+ *
+ * @param distinct The distinct characters.
+ * @param num_distinct Number of distinct characters.
+ * @param num_slots Zero based number of slots (below 255).
+ * @return Index of the first prime with no collisions, -1 if every prime has a collision.
+ */
+static int find_hash_prime(const uint8_t *distinct, size_t num_distinct, uint8_t num_slots) {
+    size_t p, i;
+    for (p = 0; p < NUM_HASH_PRIMES; p++) {
+        uint64_t used[4] = {0, 0, 0, 0};
+        for (i = 0; i < num_distinct; i++) {
+            uint8_t slot = hash_function(distinct[i], hash_primes[p], num_slots);
+            if (used[slot >> 6] & ((uint64_t)1 << (slot & 63))) {
+                break; // Collision
+            }
+            used[slot >> 6] |= (uint64_t)1 << (slot & 63);
+        }
+        if (i == num_distinct) {
+            return (int)p;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Generates the best hash table for the given characters.
+ *
+ * The hash table is stored in a dynamically allocated buffer.
+ *
+ * A table with no collisions has each character in its own slot, so it only depends on the distinct characters:
+ * they are counted once and each a and table size is tried on them alone. The first table with no collisions
+ * is the best (its largest slot is the most frequent character).
+ *
+ * The search for the smallest table with no collisions (a and the number of slots) only goes on while a hashed
+ * layout of that size could beat the compact layouts (see choose_layout()) - after that, and for
+ * ACPH_EFFORT_FAST, the 256 slot natural table is used. Once the build's time budget is spent the search goes
+ * straight to the natural table.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters in the array.
+ * @param min_unique_chars The minimum number of unique characters.
+ * @param ctx Build settings (node flags, cost model, effort, time budget and threads).
+ * @return Pointer to the root node of the created hash table.
+ */
+static HashNode* find_best_hash(uint8_t *characters, size_t num_chars, size_t min_unique_chars, const BuildContext *ctx) {
+    size_t counts[256];
+    uint8_t distinct[256];
+    size_t num_distinct = 0;
+    SLOT best_slot_table[256];
+    int best_prime = -1;
+    size_t c;
+    uint8_t num_slots; // Zero based number of slots
+    uint8_t flags = ctx->flags;
+    size_t bytes_per_cycle = CTX_BYTES_PER_CYCLE(ctx);
+
+    count_characters(characters, num_chars, ctx, counts);
+    for (c = 0; c < 256; c++) {
+        if (counts[c] > 0) {
+            distinct[num_distinct++] = (uint8_t)c;
+        }
+    }
+
+    num_slots = min_unique_chars < 256 ? min_unique_chars - 1 : 254; // Initialize with the minimum number of unique characters
+    do {
+        // Hashed tables only get dearer with more slots - once one can not beat the compact layouts (or there is no
+        // time) go on to the natural table, which has no collisions
+        if (num_slots < 254 && (ctx->effort == ACPH_EFFORT_FAST || build_expired(ctx) ||
+            choose_layout(min_unique_chars, (uint8_t)(num_slots + 1), flags, bytes_per_cycle) != HASHNODE_HASHED)) {
+            num_slots = 254;
+        }
+        num_slots++;
+        // The natural table (num_slots 255) is indexed by the character whatever the prime
+        best_prime = num_slots == 255 ? 0 : find_hash_prime(distinct, num_distinct, num_slots);
+    } while (best_prime < 0);
+
+    memset(best_slot_table, 0, sizeof(best_slot_table));
+    for (c = 0; c < num_distinct; c++) {
+        SLOT *slot = &best_slot_table[hash_function(distinct[c], hash_primes[best_prime], num_slots)];
+        slot->character = distinct[c];
+        slot->count = (int)counts[distinct[c]];
+    }
+    return create_node(best_slot_table, hash_primes[best_prime], num_slots, flags, bytes_per_cycle);
+}
+
+/**
+ * @brief Builds a character node with the given flags.
+ *
+ * This function returns the best (smallest) hash table for the given characters.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param num_chars Number of characters in the array.
+ * @param flags Node flags (HASHNODE_SET for a set node, 0 for a payload node).
+ * @return Pointer to the root node of the created hash table.
+ */
+static HashNode* build_character_node(uint8_t *characters, Payload *payloads, size_t num_chars, uint8_t flags) {
+    BuildContext ctx;
+    size_t best_possible_score;
+    size_t min_unique_chars;
+    HashNode *node;
+    size_t i;
+
+    calculate_character_distribution(characters, num_chars, &min_unique_chars, &best_possible_score);
+
+    memset(&ctx, 0, sizeof(BuildContext));
+    ctx.flags = flags;
+    node = find_best_hash(characters, num_chars, min_unique_chars, &ctx);
+
+    // For a character hash it is always perfect so any counts > 1 just means duplicate inputs - we set count to 1
+    // Note the binary hash will need to know the counts > 1, which is why we clear them here and not in find_best_hash()
+    for (i = 0; i <= node->num_slots; i++) {
+        if (HASHNODE_SLOT(node, i)->count > 1) {
+            HASHNODE_SLOT(node, i)->count = 1;
+        }
+    }
+
+    if (flags & HASHNODE_SET) {
+        return node; // No payloads to set
+    }
+
+    // We need to set the payload for the slot
+    // Loop through the characters, find the slot and set the payload
+    for (i = 0; i < num_chars; i++) {
+        HashSlot *slot = node_slot(node, characters[i]);
+        if (slot != NULL && slot->count == 1 && slot->character == characters[i]) {
+            slot->payload = payloads[i];
+        }
+    }
+
+    return node;
+}
+
+/**
+ * @brief Builds a hash table for characters/bytes provided as a binary & length.
+ *
+ * This function returns the best (smallest) hash table for the given characters.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_chars Number of characters in the array.
+ * @return Pointer to the root node of the created hash table.
+ */
+HashNode* create_character_hash(uint8_t *characters, Payload *payloads, size_t num_chars) {
+    return build_character_node(characters, payloads, num_chars, 0);
+}
+
+/**
+ * @brief Builds a set (no payloads) for characters/bytes provided as a binary & length.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters in the array.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_character_set(uint8_t *characters, size_t num_chars) {
+    return build_character_node(characters, NULL, num_chars, HASHNODE_SET);
+}
+
+/**
+ * @brief Copies the payload of a found slot to the caller.
+ *
+ * Set nodes have no payload so a zero payload is returned for them.
+ *
+ * @param node Pointer to the hash node.
+ * @param slot Pointer to the found slot.
+ * @param payload_out Pointer to the payload to be set (may be NULL).
+ */
+static void copy_payload(const HashNode *node, const HashSlot *slot, Payload *payload_out) {
+    if (payload_out != NULL) {
+        if (node->flags & HASHNODE_SET) {
+            *payload_out = (Payload){0};
+        }
+        else {
+            *payload_out = slot->payload;
+        }
+    }
+}
+
+/**
+ * @brief Looks up a character in the hash node.
+ *
+ * This function returns the slot index if the character is found, -1 otherwise.
+ *
+ * @param character The character to look up.
+ * @param node Pointer to the hash node.
+ * @param payload_out Pointer to the variable to store the payload if the character is found.
+ * @return The slot index if the character is found, -1 otherwise.
+ */
+int lookup_character(uint8_t character, const HashNode *node, Payload *payload_out) {
+    const HashSlot *slot = node_slot(node, character);
+    if (slot != NULL && slot->count > 0 && slot->character == character) {
+        copy_payload(node, slot, payload_out);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the byte of a binary at a column - columns past the end of the binary read as 0.
+ *
+ * @param value Pointer to the binary value.
+ * @param column Column position.
+ * @return The byte at the column or 0.
+ */
+static uint8_t column_character(const BinaryValue *value, size_t column) {
+    if (column >= value->length) {
+        return 0;
+    }
+    return value->binary[column];
+}
+
+/**
+ * @brief Calculates a 64 bit hash of a binary.
+ *
+ * The bytes are mixed 8 at a time so hashing a long key is cheaper than the cache misses it can save.
+ * The result depends on the platform byte order, which is fine as trees are never shared between platforms.
+ *
+ * @param value Pointer to the binary value.
+ * @return The hash.
+ */
+static uint64_t binary_hash(const BinaryValue *value) {
+    size_t i;
+    uint64_t word;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)value->length;
+    for (i = 0; i + 8 <= value->length; i += 8) {
+        memcpy(&word, value->binary + i, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+    }
+    word = 0;
+    memcpy(&word, value->binary + i, value->length - i);
+    hash = (hash ^ word) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * @brief Calculates the fingerprint of a binary for a filter leaf.
+ *
+ * The low 32 bits of binary_hash() folded down to the requested number of bits.
+ *
+ * @param value Pointer to the binary value.
+ * @param bits Number of fingerprint bits (8, 16 or 32).
+ * @return The fingerprint.
+ */
+static uint32_t binary_fingerprint(const BinaryValue *value, uint8_t bits) {
+    uint32_t hash = (uint32_t)binary_hash(value);
+    if (bits < 32) {
+        hash ^= hash >> 16;
+        if (bits < 16) {
+            hash ^= hash >> 8;
+        }
+        hash &= (1u << bits) - 1;
+    }
+    return hash;
+}
+
+/**
+ * @brief Calculates the 8 bit fingerprint held in a leaf slot to reject most misses before the stored binary is read.
+ *
+ * Every leaf visit pays for this, hits included, so it reads at most 16 bytes whatever the key length: the first
+ * and the last 8 bytes (all of a shorter key) mixed with the length. Keys that differ only in the middle share a
+ * fingerprint and are told apart by compare_leaf().
+ *
+ * @param value Pointer to the binary value.
+ * @return The fingerprint.
+ */
+static uint8_t leaf_fingerprint(const BinaryValue *value) {
+    uint64_t head = 0, tail = 0;
+    uint64_t hash;
+    if (value->length >= 8) {
+        memcpy(&head, value->binary, 8);
+        memcpy(&tail, value->binary + value->length - 8, 8);
+    } else {
+        size_t i;
+        for (i = 0; i < value->length; i++) {
+            head = (head << 8) | value->binary[i];
+        }
+    }
+    hash = (head ^ (uint64_t)value->length) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 32) ^ tail) * 0xbf58476d1ce4e5b9ULL;
+    return (uint8_t)(hash >> 56);
+}
+
+/**
+ * @brief Checks if a column is on a path.
+ *
+ * @param path Path to check.
+ * @param column Column to check for.
+ * @return 1 if the column is on the path, 0 otherwise.
+ */
+static int column_on_path(const PathColumn *path, size_t column) {
+    for (; path != NULL; path = path->parent) {
+        if (path->column == column) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a leaf for a binary.
+ *
+ * The prefix and suffix of the binary made up of columns on the path are left out of the range to compare.
+ *
+ * @param value Pointer to the binary value.
+ * @param path Columns on the path to the leaf (including the leaf's own node).
+ * @return Pointer to the new leaf.
+ */
+static LeafValue *create_leaf(const BinaryValue *value, const PathColumn *path) {
+    LeafValue *leaf = malloc(sizeof(LeafValue));
+    if (leaf == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    leaf->value = *value;
+    leaf->verify_start = 0;
+    while (leaf->verify_start < value->length && column_on_path(path, leaf->verify_start)) {
+        leaf->verify_start++;
+    }
+    leaf->verify_end = value->length;
+    while (leaf->verify_end > leaf->verify_start && column_on_path(path, leaf->verify_end - 1)) {
+        leaf->verify_end--;
+    }
+    return leaf;
+}
+
+int compare_binaries(const BinaryValue *str1, const BinaryValue *str2);
+
+/**
+ * @brief Builds a bucket node - the binaries are held in leaf slots that are not hashed.
+ *
+ * The leaf fingerprints of the slots are packed into the node (BUCKET_FINGERPRINTS) so a lookup can compare them
+ * all at once rather than going down another level.
+ *
+ * @param values Pointer to the array of binary values (at most ACPH_MAX_BUCKET_SIZE).
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched on the path to the bucket.
+ * @return Pointer to the bucket node, NULL if there is a duplicate.
+ */
+static HashNode *build_bucket_node(BinaryValue *values, Payload *payloads, size_t num_values, const BuildContext *ctx, const PathColumn *path) {
+    size_t i, j;
+    uint32_t fingerprints = 0;
+
+    for (i = 0; i < num_values; i++) {
+        for (j = i + 1; j < num_values; j++) {
+            if (compare_binaries(&values[i], &values[j])) {
+                return NULL; // Duplicate - an input error
+            }
+        }
+    }
+
+    HashNode *node = (HashNode *)malloc(HASHNODE_SIZEFORNUMSLOTS(num_values - 1, ctx->flags));
+    if (node == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    node->prime = 0;
+    node->num_slots = (uint8_t)(num_values - 1);
+    node->flags = ctx->flags;
+    node->fingerprint_bits = ctx->fingerprint_bits;
+    node->kind = HASHNODE_BUCKET;
+    node->layout = HASHNODE_HASHED; // Not used - bucket slots are not looked up by a character
+    node->keys_size = 0;
+    for (i = 0; i < num_values; i++) {
+        HashSlot *slot = HASHNODE_SLOT(node, i);
+        slot->character = 0;
+        slot->count = 1;
+        slot->next_node.leaf = create_leaf(&values[i], path);
+        slot->leaf_fingerprint = leaf_fingerprint(&values[i]);
+        slot->leaf_length = LEAF_LENGTH(values[i].length);
+        if (!(ctx->flags & HASHNODE_SET)) {
+            slot->payload = payloads[i];
+        }
+        fingerprints |= (uint32_t)slot->leaf_fingerprint << (8 * i);
+    }
+    node->column = fingerprints;
+    build_placed(ctx, num_values, 1);
+    return node;
+}
+
+static HashNode *build_binary_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values, const BuildContext *ctx, const PathColumn *path, const size_t *columns, size_t num_columns);
+
+/**
+ * @brief Widens an array of characters to node keys (see build_slots()).
+ *
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters.
+ * @return Pointer to the new array of keys.
+ */
+static uint16_t *widen_characters(const uint8_t *characters, size_t num_chars) {
+    size_t i;
+    uint16_t *keys = (uint16_t *)malloc(num_chars * sizeof(uint16_t));
+    if (keys == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < num_chars; i++) {
+        keys[i] = characters[i];
+    }
+    return keys;
+}
+
+/**
+ * @brief Fills in the slots of a node from the values and recursively builds the child nodes.
+ *
+ * @param node Pointer to the node (from find_best_hash() or create_wide_node()).
+ * @param node_keys The key of each value that the node hashes - the character, or the 16 bit key for wide nodes.
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched on the path including this node.
+ * @param columns Candidate columns for the child nodes (NULL for all columns).
+ * @param num_columns Number of candidate columns.
+ * @return 1 on success, 0 if a duplicate was found (or the depth bound can not be met) - in which case the node has
+ * been freed.
+ */
+static int build_slots(HashNode *node, const uint16_t *node_keys, BinaryValue *values, Payload *payloads, const double *weights, size_t num_values, const BuildContext *ctx, const PathColumn *path, const size_t *columns, size_t num_columns) { // NOLINT
+    size_t i, j;
+    size_t num_node_slots = HASHNODE_SLOT_COUNT(node);
+    size_t slot_size = HASHSLOT_SIZE(node->flags);
+
+    // Under a depth bound the child nodes have a level less left (and only this node's child groups are recorded)
+    BuildContext child_ctx = *ctx;
+    if (child_ctx.levels) {
+        child_ctx.levels--;
+    }
+    child_ctx.depth_failure = NULL;
+
+    // Sort the values by slot (a stable counting sort) so the values of each slot are together in 'order'
+    size_t *value_slot = (size_t *)malloc(num_values * sizeof(size_t));
+    size_t *order = (size_t *)malloc(num_values * sizeof(size_t));
+    size_t *slot_end = (size_t *)calloc(num_node_slots + 1, sizeof(size_t));
+    if (value_slot == NULL || order == NULL || slot_end == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (j = 0; j < num_values; j++) {
+        value_slot[j] = ((uint8_t *)node_slot(node, node_keys[j]) - (uint8_t *)HASHNODE_SLOT(node, 0)) / slot_size;
+        slot_end[value_slot[j] + 1]++;
+    }
+    for (i = 0; i < num_node_slots; i++) {
+        slot_end[i + 1] += slot_end[i];
+    }
+    for (j = 0; j < num_values; j++) {
+        // Moves the start of each slot along so that afterwards slot_end[i] is the end of slot i
+        order[slot_end[value_slot[j]]++] = j;
+    }
+    free(value_slot);
+    build_placed(ctx, 0, 1);
+
+    // Process values by hash values and create child nodes recursively
+    for (i = 0; i < num_node_slots; i++) {
+        HashSlot *slot = HASHNODE_SLOT(node, i);
+        size_t first = i ? slot_end[i - 1] : 0;
+        if (slot_end[i] - first != (size_t)slot->count) {
+            // Panic the binary is not found
+            fprintf(stderr, "PANIC: Binary not found\n");
+            exit(1);
+        }
+        if (slot->count == 0) {
+            slot->next_node.child = NULL;
+        }
+        else if (slot->count == 1) {
+            // The binary that hashes to this slot
+            j = order[first];
+            if (ctx->flags & HASHNODE_FILTER) {
+                // Filters only keep the fingerprint of the binary
+                slot->next_node.fingerprint = binary_fingerprint(&values[j], ctx->fingerprint_bits);
+            }
+            else if (ctx->flags & HASHNODE_RETRIEVAL) {
+                // Retrieval trees keep nothing of the binary
+                slot->next_node.leaf = NULL;
+            }
+            else {
+                slot->next_node.leaf = create_leaf(&values[j], path);
+                slot->leaf_fingerprint = leaf_fingerprint(&values[j]);
+                slot->leaf_length = LEAF_LENGTH(values[j].length);
+            }
+            // Set the payload
+            if (!(ctx->flags & HASHNODE_SET)) {
+                slot->payload = payloads[j];
+            }
+            build_placed(ctx, 1, 0);
+        }
+        else if (slot->count > 0) {
+            // Create a list of values that hash to this slot
+            BinaryValue *grouped_strings = (BinaryValue *)malloc(slot->count * sizeof(BinaryValue));
+            if (grouped_strings == NULL) {
+                // Handle memory allocation error - our standard is to exit with a PANIC message
+                fprintf(stderr, "PANIC: Memory allocation error\n");
+                exit(1);
+            }
+            // Create a list of payloads that hash to this slot (sets have none)
+            Payload *grouped_payloads = NULL;
+            if (!(ctx->flags & HASHNODE_SET)) {
+                grouped_payloads = (Payload *)malloc(slot->count * sizeof(Payload));
+                if (grouped_payloads == NULL) {
+                    // Handle memory allocation error - our standard is to exit with a PANIC message
+                    fprintf(stderr, "PANIC: Memory allocation error\n");
+                    exit(1);
+                }
+            }
+            // Create a list of the weights of the values in this slot (if weighted)
+            double *grouped_weights = NULL;
+            if (weights != NULL) {
+                grouped_weights = (double *)malloc(slot->count * sizeof(double));
+                if (grouped_weights == NULL) {
+                    // Handle memory allocation error - our standard is to exit with a PANIC message
+                    fprintf(stderr, "PANIC: Memory allocation error\n");
+                    exit(1);
+                }
+            }
+            int count = 0;
+            for (j = first; j < slot_end[i]; j++) {
+                grouped_strings[count] = values[order[j]];
+                if (grouped_payloads) grouped_payloads[count] = payloads[order[j]];
+                if (grouped_weights) grouped_weights[count] = weights[order[j]];
+                count++;
+            }
+
+            // Recursively build the child node for this group - or a bucket if it is small enough
+            if (ctx->levels == 1) {
+                slot->next_node.child = NULL; // No levels left for the group - over the depth bound
+            }
+            else if (count <= ctx->bucket_size) {
+                slot->next_node.child = build_bucket_node(grouped_strings, grouped_payloads, count, &child_ctx, path);
+            }
+            else {
+                slot->next_node.child = build_binary_node(grouped_strings, grouped_payloads, grouped_weights, count, &child_ctx, path, columns, num_columns);
+            }
+            free(grouped_payloads);
+            free(grouped_weights);
+            if (slot->next_node.child == NULL && ctx->depth_failure != NULL && !build_cancelled(ctx)) {
+                // Keep the group over the depth bound for the other nodes tried for this group
+                free(ctx->depth_failure->values);
+                ctx->depth_failure->values = grouped_strings;
+                ctx->depth_failure->num_values = (size_t)count;
+                ctx->depth_failure->levels = ctx->levels - 1;
+            }
+            else {
+                free(grouped_strings);
+            }
+
+            if (slot->next_node.child == NULL) {
+                // NULL - means a duplicate has been found - an input error (or the depth bound can not be met,
+                // or the build was cancelled)
+                // Free any mallocs and return NULL
+                for (j = i + 1; j < num_node_slots; j++) {
+                    // Clear the slots not built yet so that free_tree() only frees the built ones
+                    HASHNODE_SLOT(node, j)->count = 0;
+                }
+                slot->count = 0;
+                discard_tree(ctx, node);
+                free(order);
+                free(slot_end);
+                return 0;
+            }
+
+        }
+    }
+
+    free(order);
+    free(slot_end);
+    return 1;
+}
+
+/**
+ * @brief Finds the best pair of adjacent columns for a wide node.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @param columns The varying columns of the values (in order) - both columns of a pair must vary.
+ * @param num_columns Number of varying columns.
+ * @param best_column Set to the first column of the best pair.
+ * @param best_max_occurrence Set to the maximum number of values with the same key for the best pair.
+ * @param best_unique_keys Set to the number of different keys for the best pair.
+ * @param best_unique_chars Set to the number of different characters in the first column of the best pair.
+ * @return 1 if there is a pair, 0 otherwise.
+ */
+static int find_best_wide_column(const BinaryValue *values, size_t num_values, const size_t *columns, size_t num_columns,
+                                 size_t *best_column, size_t *best_max_occurrence, size_t *best_unique_keys, size_t *best_unique_chars) {
+    size_t i, k;
+    int found = 0;
+    uint32_t *key_counts = (uint32_t *)calloc(65536, sizeof(uint32_t));
+    if (key_counts == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (k = 0; k + 1 < num_columns; k++) {
+        size_t c = columns[k];
+        size_t max_occurrence = 0, unique_keys = 0, unique_chars = 0;
+        uint8_t char_seen[256] = {0};
+        if (columns[k + 1] != c + 1) {
+            continue;
+        }
+        for (i = 0; i < num_values; i++) {
+            uint8_t first = column_character(&values[i], c);
+            unsigned int key = WIDE_KEY(first, column_character(&values[i], c + 1));
+            if (key_counts[key]++ == 0) {
+                unique_keys++;
+            }
+            if (key_counts[key] > max_occurrence) {
+                max_occurrence = key_counts[key];
+            }
+            if (!char_seen[first]) {
+                char_seen[first] = 1;
+                unique_chars++;
+            }
+        }
+        // Only the counts used need clearing
+        for (i = 0; i < num_values; i++) {
+            key_counts[WIDE_KEY(column_character(&values[i], c), column_character(&values[i], c + 1))] = 0;
+        }
+        if (!found || max_occurrence < *best_max_occurrence) {
+            found = 1;
+            *best_column = c;
+            *best_max_occurrence = max_occurrence;
+            *best_unique_keys = unique_keys;
+            *best_unique_chars = unique_chars;
+        }
+    }
+    free(key_counts);
+    return found;
+}
+
+/**
+ * @brief Checks with the lookup cost model if a wide node pays off.
+ *
+ * The wide node is compared with the two levels it replaces - a node for its first column with a child node on
+ * the second column for each character. The wide node saves each of its values a level, which is worth
+ * bytes_per_cycle * LOOKUP_CYCLES_LEVEL bytes per value.
+ *
+ * @param num_values Number of binary values.
+ * @param unique_keys Number of different 16 bit keys.
+ * @param unique_chars Number of different characters in the first column.
+ * @param flags Node flags (HASHNODE_SET) - these determine the slot size.
+ * @param bytes_per_cycle What a lookup cycle is worth in bytes (see choose_layout()).
+ * @return 1 if the wide node pays off, 0 otherwise.
+ */
+static int wide_node_pays_off(size_t num_values, size_t unique_keys, size_t unique_chars, uint8_t flags, size_t bytes_per_cycle) {
+    size_t slot_size = HASHSLOT_SIZE(flags);
+    size_t wide_bytes = sizeof(HashNode) + sizeof(WideBitmap) + unique_keys * slot_size;
+    size_t two_level_bytes = sizeof(HashNode) + sizeof(SlotBitmap) + unique_chars * (slot_size + sizeof(HashNode) + 16) +
+                             unique_keys * slot_size;
+    return wide_bytes <= two_level_bytes + num_values * bytes_per_cycle * LOOKUP_CYCLES_LEVEL;
+}
+
+/**
+ * @brief Creates a wide node for the given 16 bit keys.
+ *
+ * @param keys The key of each value.
+ * @param num_values Number of values.
+ * @param unique_keys Number of different keys (the number of slots).
+ * @param flags Node flags (HASHNODE_SET) - these determine the slot layout.
+ * @return Pointer to the new node.
+ */
+static HashNode *create_wide_node(const uint16_t *keys, size_t num_values, size_t unique_keys, uint8_t flags) {
+    size_t i;
+    HashNode *node = (HashNode *)malloc(HASHNODE_SIZEFORNUMSLOTS(unique_keys - 1, flags) + sizeof(WideBitmap));
+    if (node == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    node->column = 0;
+    node->prime = 0;
+    node->num_slots = 255; // Not used - see HASHNODE_SLOT_COUNT
+    node->flags = flags;
+    node->fingerprint_bits = 0;
+    node->kind = HASHNODE_COLUMN16;
+    node->layout = HASHNODE_BITMAP16;
+    node->keys_size = sizeof(WideBitmap);
+
+    WideBitmap *bitmap = (WideBitmap *)HASHNODE_KEYS(node);
+    memset(bitmap, 0, sizeof(WideBitmap));
+    for (i = 0; i < num_values; i++) {
+        bitmap->bits[keys[i] >> 6] |= (uint64_t)1 << (keys[i] & 63);
+    }
+    for (i = 1; i < 1024; i++) {
+        bitmap->rank[i] = (uint16_t)(bitmap->rank[i - 1] + popcount64(bitmap->bits[i - 1]));
+    }
+    bitmap->num_slots = (uint32_t)unique_keys;
+
+    for (i = 0; i < unique_keys; i++) {
+        HashSlot *slot = HASHNODE_SLOT(node, i);
+        slot->count = 0;
+        slot->character = 0;
+        slot->leaf_fingerprint = 0;
+        slot->leaf_length = 0;
+        slot->next_node.child = NULL;
+        if (!(flags & HASHNODE_SET)) {
+            slot->payload = (Payload){0};
+        }
+    }
+    for (i = 0; i < num_values; i++) {
+        HashSlot *slot = node_slot(node, keys[i]);
+        slot->count++;
+        slot->character = (uint8_t)keys[i]; // The low byte, as the lookups check
+    }
+    return node;
+}
+
+/**
+ * @brief Finds the best pair of columns to combine in a pair node.
+ *
+ * Only pairs of the PAIR_CANDIDATES columns that split the values best on their own are tried.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @param columns The varying columns of the values.
+ * @param column_max_occurrence The maximum number of values with the same character for each varying column.
+ * @param num_columns Number of varying columns.
+ * @param best_first Set to the first column of the best pair.
+ * @param best_second Set to the second column of the best pair.
+ * @param best_max_occurrence Set to the maximum number of values with the same character for the best pair.
+ * @param best_unique_chars Set to the number of different characters for the best pair.
+ * @param best_chars Set to the character of each value for the best pair.
+ * @return 1 if there is a pair, 0 otherwise.
+ */
+static int find_best_pair_columns(const BinaryValue *values, size_t num_values, const size_t *columns,
+                                  const size_t *column_max_occurrence, size_t num_columns, size_t *best_first,
+                                  size_t *best_second, size_t *best_max_occurrence, size_t *best_unique_chars,
+                                  uint8_t *best_chars) {
+    size_t candidates[PAIR_CANDIDATES];
+    size_t num_candidates = 0;
+    size_t i, j, k;
+    int found = 0;
+
+    // The best columns on their own, in column order
+    for (k = 0; k < num_columns; k++) {
+        if (num_candidates < PAIR_CANDIDATES) {
+            candidates[num_candidates++] = k;
+        }
+        else {
+            // Replace the worst candidate if this column is better
+            size_t worst = 0;
+            for (i = 1; i < num_candidates; i++) {
+                if (column_max_occurrence[candidates[i]] > column_max_occurrence[candidates[worst]]) {
+                    worst = i;
+                }
+            }
+            if (column_max_occurrence[k] < column_max_occurrence[candidates[worst]]) {
+                for (i = worst; i + 1 < num_candidates; i++) {
+                    candidates[i] = candidates[i + 1];
+                }
+                candidates[num_candidates - 1] = k;
+            }
+        }
+    }
+
+    uint8_t *pair_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (pair_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < num_candidates; i++) {
+        for (j = i + 1; j < num_candidates; j++) {
+            size_t first = columns[candidates[i]], second = columns[candidates[j]];
+            size_t unique_chars, max_occurrence;
+            for (k = 0; k < num_values; k++) {
+                pair_chars[k] = PAIR_CHARACTER(column_character(&values[k], first), column_character(&values[k], second));
+            }
+            calculate_character_distribution(pair_chars, num_values, &unique_chars, &max_occurrence);
+            if (!found || max_occurrence < *best_max_occurrence) {
+                found = 1;
+                *best_first = first;
+                *best_second = second;
+                *best_max_occurrence = max_occurrence;
+                *best_unique_chars = unique_chars;
+                memcpy(best_chars, pair_chars, num_values * sizeof(uint8_t));
+            }
+        }
+    }
+    free(pair_chars);
+    return found;
+}
+
+/**
+ * @brief Selects the best scoring columns for the beam search.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param columns The candidate columns.
+ * @param num_columns Number of candidate columns.
+ * @param ctx Build settings (column scoring and beam width).
+ * @param beam Set to the best scoring columns that vary, best first (up to ctx->beam_width entries).
+ * @return The number of columns in the beam.
+ */
+static size_t select_beam_columns(const BinaryValue *values, const double *weights, size_t num_values,
+                                  const size_t *columns, size_t num_columns, const BuildContext *ctx, size_t *beam) {
+    double beam_scores[ACPH_MAX_BEAM_WIDTH];
+    size_t num_beam = 0;
+    size_t i, j, k, unique_chars, max_occurrence;
+    uint8_t *column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (column_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (k = 0; k < num_columns; k++) {
+        double score;
+        for (i = 0; i < num_values; i++) {
+            column_chars[i] = column_character(&values[i], columns[k]);
+        }
+        score = score_column(column_chars, weights, num_values, ctx->column_scoring, &unique_chars, &max_occurrence);
+        if (unique_chars < 2 || (num_beam == ctx->beam_width && score >= beam_scores[num_beam - 1])) {
+            continue;
+        }
+        // Insert in score order - after columns with the same score, so the greedy choice stays first
+        if (num_beam < ctx->beam_width) {
+            num_beam++;
+        }
+        for (j = num_beam - 1; j > 0 && beam_scores[j - 1] > score; j--) {
+            beam_scores[j] = beam_scores[j - 1];
+            beam[j] = beam[j - 1];
+        }
+        beam_scores[j] = score;
+        beam[j] = columns[k];
+    }
+    free(column_chars);
+    return num_beam;
+}
+
+/**
+ * @brief Builds a wide node on a pair of adjacent columns.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param num_varying_columns Number of varying columns.
+ * @param wide_column The first column of the pair.
+ * @param wide_unique_keys Number of different 16 bit keys of the pair.
+ * @return Pointer to the node, NULL for duplicates.
+ */
+static HashNode *build_wide_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                 const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                 size_t num_varying_columns, size_t wide_column, size_t wide_unique_keys) {
+    HashNode *node;
+    PathColumn node_path, second_path;
+    size_t i;
+    uint16_t *node_keys = (uint16_t *)malloc(num_values * sizeof(uint16_t));
+    if (node_keys == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < num_values; i++) {
+        node_keys[i] = (uint16_t)WIDE_KEY(column_character(&values[i], wide_column),
+                                          column_character(&values[i], wide_column + 1));
+    }
+    node = create_wide_node(node_keys, num_values, wide_unique_keys, ctx->flags);
+    node->column = wide_column;
+    node->fingerprint_bits = ctx->fingerprint_bits;
+    // Both columns are matched by the node
+    node_path.column = wide_column;
+    node_path.parent = path;
+    second_path.column = wide_column + 1;
+    second_path.parent = &node_path;
+    if (!build_slots(node, node_keys, values, payloads, weights, num_values, ctx, &second_path, varying_columns, num_varying_columns)) {
+        node = NULL;
+    }
+    free(node_keys);
+    return node;
+}
+
+/**
+ * @brief Builds a pair node on two columns combined.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param num_varying_columns Number of varying columns.
+ * @param pair_first The first column of the pair.
+ * @param pair_second The second column of the pair.
+ * @param pair_max_occurrence The maximum number of values with the same combined character.
+ * @param pair_unique_chars Number of different combined characters.
+ * @param pair_chars The combined character of each value.
+ * @return Pointer to the node, NULL for duplicates.
+ */
+static HashNode *build_pair_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                 const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                 size_t num_varying_columns, size_t pair_first, size_t pair_second,
+                                 size_t pair_max_occurrence, size_t pair_unique_chars, uint8_t *pair_chars) {
+    HashNode *node = find_best_hash(pair_chars, num_values, pair_unique_chars, ctx);
+    // The second column goes after the slots
+    size_t node_bytes = HASHNODE_BYTES(node);
+    node = (HashNode *)realloc(node, node_bytes + sizeof(size_t));
+    if (node == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    node->kind = HASHNODE_PAIR;
+    node->column = pair_first;
+    PAIR_COLUMN(node) = pair_second;
+    node->fingerprint_bits = ctx->fingerprint_bits;
+
+    // Only the combination of the columns is matched, not the columns, so they are not added to the path
+    uint16_t *node_keys = widen_characters(pair_chars, num_values);
+    if (!build_slots(node, node_keys, values, payloads, weights, num_values, ctx, path, varying_columns, num_varying_columns)) {
+        node = NULL;
+    }
+    free(node_keys);
+    return node;
+}
+
+/**
+ * @brief Builds a node on a single column.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param num_varying_columns Number of varying columns.
+ * @param column The column of the node.
+ * @param column_chars The character of each value in the column.
+ * @param num_slots The maximum number of values with the same character.
+ * @param unique_chars Number of different characters.
+ * @return Pointer to the node, NULL for duplicates.
+ */
+static HashNode *build_single_column_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                          const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                          size_t num_varying_columns, size_t column, uint8_t *column_chars,
+                                          size_t num_slots, size_t unique_chars) {
+    HashNode *node = find_best_hash(column_chars, num_values, unique_chars, ctx);
+    node->column = column;
+    node->fingerprint_bits = ctx->fingerprint_bits;
+    PathColumn node_path;
+    node_path.column = column;
+    node_path.parent = path;
+
+    uint16_t *node_keys = widen_characters(column_chars, num_values);
+    if (!build_slots(node, node_keys, values, payloads, weights, num_values, ctx, &node_path, varying_columns, num_varying_columns)) {
+        node = NULL;
+    }
+    free(node_keys);
+    return node;
+}
+
+/**
+ * @brief Builds a node on a column (or on a wide or pair node including the column if they do better).
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings - applied to every node in the tree.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param varying_max_occurrence The maximum number of values with the same character for each varying column.
+ * @param num_varying_columns Number of varying columns.
+ * @param column The column of the node.
+ * @return Pointer to the node, NULL for duplicates.
+ */
+static HashNode *build_column_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                   const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                   const size_t *varying_max_occurrence, size_t num_varying_columns, size_t column) {
+    HashNode *node;
+    uint8_t *column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (column_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    uint8_t *best_column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (best_column_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    size_t best_num_slots, best_unique_chars;
+    size_t i;
+    for (i = 0; i < num_values; i++) {
+        best_column_chars[i] = column_character(&values[i], column);
+    }
+    calculate_character_distribution(best_column_chars, num_values, &best_unique_chars, &best_num_slots);
+
+    // A wide node on the best pair of adjacent columns if it splits the values better and it pays off
+    size_t wide_column, wide_max_occurrence, wide_unique_keys, wide_unique_chars;
+    size_t pair_first, pair_second, pair_max_occurrence, pair_unique_chars;
+    if (ctx->wide_columns && num_values >= WIDE_MIN_VALUES &&
+        find_best_wide_column(values, num_values, varying_columns, num_varying_columns,
+                              &wide_column, &wide_max_occurrence, &wide_unique_keys, &wide_unique_chars) &&
+        wide_max_occurrence < best_num_slots &&
+        wide_node_pays_off(num_values, wide_unique_keys, wide_unique_chars, ctx->flags, CTX_BYTES_PER_CYCLE(ctx))) {
+        node = build_wide_node(values, payloads, weights, num_values, ctx, path, varying_columns, num_varying_columns,
+                               wide_column, wide_unique_keys);
+    }
+    // A pair node on two columns combined if the column splits the values poorly and the pair does much better
+    else if (best_unique_chars <= PAIR_MAX_UNIQUE_CHARS && best_num_slots >= PAIR_MIN_OCCURRENCE &&
+             find_best_pair_columns(values, num_values, varying_columns, varying_max_occurrence, num_varying_columns,
+                                    &pair_first, &pair_second, &pair_max_occurrence, &pair_unique_chars, column_chars) &&
+             pair_max_occurrence * 2 <= best_num_slots) {
+        node = build_pair_node(values, payloads, weights, num_values, ctx, path, varying_columns, num_varying_columns,
+                               pair_first, pair_second, pair_max_occurrence, pair_unique_chars, column_chars);
+    }
+    // Otherwise a node for the column
+    else {
+        node = build_single_column_node(values, payloads, weights, num_values, ctx, path, varying_columns,
+                                        num_varying_columns, column, best_column_chars, best_num_slots, best_unique_chars);
+    }
+    free(column_chars);
+    free(best_column_chars);
+    return node;
+}
+
+/**
+ * @brief Chooses the column of a node with a beam search.
+ *
+ * The subtree below each of the best scoring columns is built (greedily) and the column whose subtree has the
+ * fewest node visits for its keys (weighted by their access weights) is chosen. Once the build's time budget is
+ * spent the best column so far is taken.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings - applied to every node in the tree.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param varying_max_occurrence The maximum number of values with the same character for each varying column.
+ * @param num_varying_columns Number of varying columns.
+ * @param best_column The best scoring column.
+ * @return The chosen column.
+ */
+static size_t choose_beam_column(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                  const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                  const size_t *varying_max_occurrence, size_t num_varying_columns, size_t best_column) {
+    size_t beam[ACPH_MAX_BEAM_WIDTH];
+    size_t num_beam, b, i;
+    double best_cost = 0;
+    int found = 0;
+    BuildContext greedy = *ctx;
+
+    greedy.beam_width = 0;
+    num_beam = select_beam_columns(values, weights, num_values, varying_columns, num_varying_columns, ctx, beam);
+    for (b = 0; b < num_beam && !(found && build_expired(ctx)) && !build_cancelled(ctx); b++) {
+        HashNode *trial = build_column_node(values, payloads, weights, num_values, &greedy, path, varying_columns,
+                                            varying_max_occurrence, num_varying_columns, beam[b]);
+        if (trial != NULL) {
+            double cost = 0;
+            for (i = 0; i < num_values; i++) {
+                cost += (weights ? weights[i] : 1.0) * (double)lookup_binary_depth(&values[i], trial);
+            }
+            discard_tree(ctx, trial);
+            if (!found || cost < best_cost) {
+                found = 1;
+                best_cost = cost;
+                best_column = beam[b];
+            }
+        }
+    }
+    return best_column;
+}
+
+/**
+ * @brief Checks whether a group can fit in the levels left under a depth bound.
+ *
+ * No node below the group splits its values into more groups than the most of: the characters of one varying
+ * column, the 16 bit keys of two adjacent ones (wide nodes) and two columns combined (pair nodes, at most 256).
+ * At the last level at most that many values are told apart, or ACPH_MAX_BUCKET_SIZE in a bucket. So at most
+ * split^(levels - 1) * max(split, bucket) values fit, and a larger group can not be built within the bound.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param varying_columns The columns that vary in this group (in order).
+ * @param num_varying_columns Number of varying columns.
+ * @param column_chars Work array of num_values characters.
+ * @return 1 if the group may fit, 0 if it can not.
+ */
+static int fits_depth_bound(const BinaryValue *values, size_t num_values, const BuildContext *ctx,
+                            const size_t *varying_columns, size_t num_varying_columns, uint8_t *column_chars) {
+    size_t last_level = (ctx->flags & HASHNODE_KEYLESS) ? 1 : ACPH_MAX_BUCKET_SIZE;
+    size_t split = 1, previous_unique = 0, top_unique[2] = {0, 0};
+    size_t i, k, level, unique_chars, max_occurrence, capacity;
+
+    if (num_values <= last_level) {
+        return 1;
+    }
+    for (k = 0; k < num_varying_columns; k++) {
+        for (i = 0; i < num_values; i++) {
+            column_chars[i] = column_character(&values[i], varying_columns[k]);
+        }
+        calculate_character_distribution(column_chars, num_values, &unique_chars, &max_occurrence);
+        if (unique_chars > split) {
+            split = unique_chars;
+        }
+        if (k > 0 && varying_columns[k] == varying_columns[k - 1] + 1 && previous_unique * unique_chars > split) {
+            split = previous_unique * unique_chars; // Wide node
+        }
+        if (unique_chars > top_unique[0]) {
+            top_unique[1] = top_unique[0];
+            top_unique[0] = unique_chars;
+        }
+        else if (unique_chars > top_unique[1]) {
+            top_unique[1] = unique_chars;
+        }
+        if (top_unique[0] * top_unique[1] > split) {
+            split = top_unique[0] * top_unique[1] < 256 ? top_unique[0] * top_unique[1] : 256; // Pair node
+        }
+        previous_unique = unique_chars;
+        if (split >= num_values) {
+            return 1;
+        }
+
+        // The most values the levels can hold with the splits found so far
+        capacity = split > last_level ? split : last_level;
+        for (level = 1; level < ctx->levels && capacity < num_values; level++) {
+            capacity = capacity > num_values / split ? num_values : capacity * split;
+        }
+        if (capacity >= num_values) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks whether a node on the given columns would keep a group that failed the depth bound together.
+ *
+ * The node would put all of the failed group in one slot, with no more levels left for it than it had, so its
+ * subtree can not be within the bound either.
+ *
+ * @param failure The group that failed (no group if its values are NULL).
+ * @param levels Levels left for the node's child groups.
+ * @param first The (first) column of the node.
+ * @param second The second column of a wide node (or the same column again).
+ * @return 1 if the node would fail the same way, 0 otherwise.
+ */
+static int keeps_failed_group(const DepthFailure *failure, size_t levels, size_t first, size_t second) {
+    size_t i;
+    if (failure->values == NULL || failure->levels < levels) {
+        return 0;
+    }
+    for (i = 1; i < failure->num_values; i++) {
+        if (column_character(&failure->values[i], first) != column_character(&failure->values[0], first) ||
+            column_character(&failure->values[i], second) != column_character(&failure->values[0], second)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builds a node whose subtree is within the depth bound (ctx->levels levels).
+ *
+ * A group too large for the levels left fails at once (see fits_depth_bound()). Otherwise the usual node is tried
+ * first. If its subtree is too deep the builder switches strategy: a wide node on the best pair of adjacent
+ * columns, then the columns that leave the smallest groups. At the last level the node has to tell all the values
+ * apart - a bucket (for up to ACPH_MAX_BUCKET_SIZE values, even if buckets are not enabled), or a column, wide or
+ * pair node with no collisions. Once a child group has failed, the nodes that would keep it together are skipped.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param varying_columns The columns that vary in this group.
+ * @param varying_max_occurrence The maximum number of values with the same character for each varying column.
+ * @param num_varying_columns Number of varying columns.
+ * @param best_column The column of the usual node.
+ * @return Pointer to the node, NULL if the depth bound can not be met.
+ */
+static HashNode *build_bounded_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values,
+                                    const BuildContext *ctx, const PathColumn *path, const size_t *varying_columns,
+                                    const size_t *varying_max_occurrence, size_t num_varying_columns, size_t best_column) {
+    size_t candidates[DEPTH_CANDIDATES];
+    size_t num_candidates = 0;
+    size_t i, j, k, unique_chars, max_occurrence;
+    size_t wide_column, wide_max_occurrence, wide_unique_keys, wide_unique_chars;
+    size_t pair_first, pair_second;
+    HashNode *node = NULL;
+    DepthFailure failure;
+    BuildContext attempt = *ctx;
+
+    if (ctx->levels == 1 && num_values <= ACPH_MAX_BUCKET_SIZE && !(ctx->flags & HASHNODE_KEYLESS)) {
+        // Buckets tell the binaries apart by their keys
+        return build_bucket_node(values, payloads, num_values, ctx, path);
+    }
+    uint8_t *column_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (column_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    if (!fits_depth_bound(values, num_values, ctx, varying_columns, num_varying_columns, column_chars)) {
+        free(column_chars);
+        return NULL;
+    }
+    // The nodes tried record a child group that fails, so the next ones can skip the columns that keep it together
+    memset(&failure, 0, sizeof(failure));
+    attempt.depth_failure = &failure;
+
+    if (ctx->levels > 1) {
+        node = build_column_node(values, payloads, weights, num_values, &attempt, path, varying_columns,
+                                 varying_max_occurrence, num_varying_columns, best_column);
+    }
+
+    // A wide node on the best pair of adjacent columns
+    if (node == NULL && !build_cancelled(ctx) &&
+        find_best_wide_column(values, num_values, varying_columns, num_varying_columns,
+                              &wide_column, &wide_max_occurrence, &wide_unique_keys, &wide_unique_chars) &&
+        (ctx->levels > 1 || wide_max_occurrence == 1) &&
+        !keeps_failed_group(&failure, ctx->levels - 1, wide_column, wide_column + 1)) {
+        node = build_wide_node(values, payloads, weights, num_values, &attempt, path, varying_columns,
+                               num_varying_columns, wide_column, wide_unique_keys);
+    }
+    if (node != NULL || build_cancelled(ctx)) {
+        free(failure.values);
+        free(column_chars);
+        return node;
+    }
+
+    // The columns that leave the smallest groups (at the last level only those with no collisions)
+    for (k = 0; k < num_varying_columns; k++) {
+        if ((ctx->levels > 1 && varying_columns[k] == best_column) ||
+            (ctx->levels == 1 && varying_max_occurrence[k] > 1) ||
+            (num_candidates == DEPTH_CANDIDATES &&
+             varying_max_occurrence[k] >= varying_max_occurrence[candidates[num_candidates - 1]])) {
+            continue;
+        }
+        if (num_candidates < DEPTH_CANDIDATES) {
+            num_candidates++;
+        }
+        for (j = num_candidates - 1; j > 0 && varying_max_occurrence[candidates[j - 1]] > varying_max_occurrence[k]; j--) {
+            candidates[j] = candidates[j - 1];
+        }
+        candidates[j] = k;
+    }
+    for (k = 0; k < num_candidates && node == NULL && !build_cancelled(ctx); k++) {
+        size_t column = varying_columns[candidates[k]];
+        if (keeps_failed_group(&failure, ctx->levels - 1, column, column)) {
+            continue;
+        }
+        for (i = 0; i < num_values; i++) {
+            column_chars[i] = column_character(&values[i], column);
+        }
+        calculate_character_distribution(column_chars, num_values, &unique_chars, &max_occurrence);
+        node = build_single_column_node(values, payloads, weights, num_values, &attempt, path, varying_columns,
+                                        num_varying_columns, column, column_chars, max_occurrence, unique_chars);
+    }
+
+    // At the last level a pair node on two columns combined
+    if (node == NULL && ctx->levels == 1 && num_values <= 256 && !build_cancelled(ctx) &&
+        find_best_pair_columns(values, num_values, varying_columns, varying_max_occurrence, num_varying_columns,
+                               &pair_first, &pair_second, &max_occurrence, &unique_chars, column_chars) &&
+        max_occurrence == 1) {
+        node = build_pair_node(values, payloads, weights, num_values, ctx, path, varying_columns, num_varying_columns,
+                               pair_first, pair_second, max_occurrence, unique_chars, column_chars);
+    }
+    free(failure.values);
+    free(column_chars);
+    return node;
+}
+
+// The candidate columns of a group scored by score_columns() - split over threads for large groups
+typedef struct ColumnScoring {
+    const BinaryValue *values; // The binaries of the group
+    const double *weights;     // Access weight of each scored binary (NULL for equal weights)
+    size_t num_values;         // Number of binaries
+    size_t stride;             // Every stride'th binary is scored (1 for all of them)
+    size_t num_scored;         // Number of binaries scored
+    const size_t *columns;     // Candidate columns (NULL for all columns)
+    size_t num_columns;        // Number of candidate columns
+    uint8_t column_scoring;    // Column scoring policy
+    double *scores;            // Set to the score of each column
+    size_t *unique_chars;      // Set to the number of different characters in each column (2 if it varies outside the sample)
+    size_t *max_occurrence;    // Set to the maximum number of binaries with the same character in each column
+} ColumnScoring;
+
+/**
+ * @brief Scores one part of the candidate columns of a group (see run_parallel()).
+ *
+ * @param arg Pointer to the ColumnScoring.
+ * @param part The part to score - a range of the columns.
+ * @param num_parts Number of parts.
+ */
+static void score_columns(void *arg, size_t part, size_t num_parts) {
+    ColumnScoring *scoring = (ColumnScoring *)arg;
+    size_t k, i, c;
+    size_t end = scoring->num_columns * (part + 1) / num_parts;
+    uint8_t *column_chars = (uint8_t *)malloc(scoring->num_scored * sizeof(uint8_t));
+    if (column_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (k = scoring->num_columns * part / num_parts; k < end; k++) {
+        // Extract characters from the current column
+        c = scoring->columns ? scoring->columns[k] : k;
+        for (i = 0; i < scoring->num_scored; i++) {
+            column_chars[i] = column_character(&scoring->values[i * scoring->stride], c);
+        }
+        scoring->scores[k] = score_column(column_chars, scoring->weights, scoring->num_scored,
+                                          scoring->column_scoring, &scoring->unique_chars[k],
+                                          &scoring->max_occurrence[k]);
+        if (scoring->unique_chars[k] == 1 && scoring->stride > 1) {
+            for (i = 0; i < scoring->num_values && column_character(&scoring->values[i], c) == column_chars[0]; i++) {
+            }
+            if (i < scoring->num_values) {
+                // Varies outside the sample
+                scoring->unique_chars[k] = 2;
+            }
+        }
+    }
+    free(column_chars);
+}
+
+/**
+ * @brief Builds the tree structure recursively from a set of binary buffers.
+ *
+ * This function creates the tree structure for the given binary values and payloads.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings - applied to every node in the tree.
+ * @param path Columns matched by the ancestors of this node (NULL for the root).
+ * @param columns Candidate columns (NULL for all columns). Only columns that vary in the parent's group can vary
+ * in this group, so the parent passes these down and columns shared by all the keys (e.g. a common prefix) are
+ * not scanned again anywhere in its subtree.
+ * @param num_columns Number of candidate columns.
+ * @return Pointer to the root node of the created hash table, NULL for duplicates (or if the depth bound can not
+ * be met).
+ */
+static HashNode *build_binary_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values, const BuildContext *ctx, const PathColumn *path, const size_t *columns, size_t num_columns) { // NOLINT
+    if (num_values < 1 || build_cancelled(ctx)) {
+        return NULL; // No values to process (or the build was cancelled)
+    }
+
+    // Find the best column with the lowest 'num_slots' values
+    size_t best_column = 0;
+    size_t best_num_slots = num_values + 1; // Initialize with a high value (no column scored yet)
+    double score, best_score = 0;
+    size_t num_slots;
+    size_t unique_chars, best_unique_chars = 1; // No varying candidate columns means the values are duplicates
+    size_t c, k;
+    size_t i;
+    if (columns == NULL) {
+        // All the columns - up to and including the first column past the longest value
+        num_columns = 0;
+        for (i = 0; i < num_values; i++) {
+            if (values[i].length > num_columns) {
+                num_columns = values[i].length;
+            }
+        }
+        num_columns++;
+    }
+    // The columns that vary in this group - the candidate columns for the child nodes
+    size_t *varying_columns = (size_t *)malloc(num_columns * sizeof(size_t));
+    if (varying_columns == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    // How well each varying column splits the values - for pair nodes
+    size_t *varying_max_occurrence = (size_t *)malloc(num_columns * sizeof(size_t));
+    if (varying_max_occurrence == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    size_t num_varying_columns = 0;
+    ColumnScoring scoring;
+    scoring.values = values;
+    scoring.weights = weights;
+    scoring.num_values = num_values;
+    scoring.stride = 1;
+    scoring.num_scored = num_values;
+    scoring.columns = columns;
+    scoring.num_columns = num_columns;
+    scoring.column_scoring = ctx->column_scoring;
+    // Fast builds (and builds past their time budget) score the columns of a large group on an even sample of
+    // its values - the column is still checked against the whole group before it is taken as constant
+    double *scored_weights = NULL;
+    if ((ctx->effort == ACPH_EFFORT_FAST || build_expired(ctx)) && num_values > 2 * SAMPLE_VALUES) {
+        scoring.stride = num_values / SAMPLE_VALUES;
+        scoring.num_scored = SAMPLE_VALUES;
+        if (weights != NULL) {
+            scored_weights = (double *)malloc(scoring.num_scored * sizeof(double));
+            if (scored_weights == NULL) {
+                // Handle memory allocation error - our standard is to exit with a PANIC message
+                fprintf(stderr, "PANIC: Memory allocation error\n");
+                exit(1);
+            }
+            for (i = 0; i < scoring.num_scored; i++) {
+                scored_weights[i] = weights[i * scoring.stride];
+            }
+            scoring.weights = scored_weights;
+        }
+    }
+    scoring.scores = (double *)malloc(num_columns * sizeof(double));
+    scoring.unique_chars = (size_t *)malloc(num_columns * sizeof(size_t));
+    scoring.max_occurrence = (size_t *)malloc(num_columns * sizeof(size_t));
+    if (scoring.scores == NULL || scoring.unique_chars == NULL || scoring.max_occurrence == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    // Large groups score their columns on the build's threads
+    run_parallel(score_columns, &scoring, build_parts(ctx, num_values, num_columns));
+    for (k = 0; k < num_columns; k++) {
+        c = columns ? columns[k] : k;
+        score = scoring.scores[k];
+        unique_chars = scoring.unique_chars[k];
+        num_slots = scoring.max_occurrence[k];
+        if (unique_chars > 1) {
+            varying_max_occurrence[num_varying_columns] = num_slots;
+            varying_columns[num_varying_columns++] = c;
+        }
+        if (best_num_slots > num_values || score < best_score) {
+            best_column = c;
+            best_score = score;
+            best_num_slots = num_slots;
+            best_unique_chars = unique_chars;
+        }
+    }
+    free(scoring.scores);
+    free(scoring.unique_chars);
+    free(scoring.max_occurrence);
+    free(scored_weights);
+
+    if (best_unique_chars == 1 && num_values > 1) {
+        // All the characters in the best column are the same - so there must be a duplicate
+        // Return NULL to signal the duplicate - which is an input error
+        free(varying_columns);
+        free(varying_max_occurrence);
+        return NULL;
+    }
+
+    // Beam search - the best scoring columns are compared by building the subtree below each of them
+    if (ctx->beam_width > 1 && num_varying_columns > 1 && num_values > ctx->bucket_size && !build_expired(ctx)) {
+        best_column = choose_beam_column(values, payloads, weights, num_values, ctx, path, varying_columns,
+                                         varying_max_occurrence, num_varying_columns, best_column);
+    }
+
+    HashNode *node;
+    if (ctx->levels) {
+        node = build_bounded_node(values, payloads, weights, num_values, ctx, path, varying_columns,
+                                  varying_max_occurrence, num_varying_columns, best_column);
+    }
+    else {
+        node = build_column_node(values, payloads, weights, num_values, ctx, path, varying_columns,
+                                 varying_max_occurrence, num_varying_columns, best_column);
+    }
+    free(varying_columns);
+    free(varying_max_occurrence);
+    return node;
+}
+
+/**
+ * @brief Builds a length node (dispatching on the length of the binaries) with column trees below it.
+ *
+ * Keys of different lengths never match, so this gives an immediate reject for lengths not in the set, and the
+ * column trees below only hold keys of one length (no zero padding collisions). If all the binaries have the same
+ * length bucket the length node is left out.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param weights Access weight of each binary (NULL for equal weights).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @return Pointer to the root node of the created hash table.
+ */
+static HashNode *build_length_node(BinaryValue *values, Payload *payloads, const double *weights, size_t num_values, const BuildContext *ctx) {
+    size_t i;
+    size_t unique_lengths, max_occurrence;
+    HashNode *node;
+    uint8_t *length_chars = (uint8_t *)malloc(num_values * sizeof(uint8_t));
+    if (length_chars == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < num_values; i++) {
+        length_chars[i] = LENGTH_BUCKET(values[i].length);
+    }
+    calculate_character_distribution(length_chars, num_values, &unique_lengths, &max_occurrence);
+    if (unique_lengths < 2) {
+        // Nothing to dispatch on
+        free(length_chars);
+        return build_binary_node(values, payloads, weights, num_values, ctx, NULL, NULL, 0);
+    }
+
+    node = find_best_hash(length_chars, num_values, unique_lengths, ctx);
+    node->kind = HASHNODE_LENGTH;
+    node->fingerprint_bits = ctx->fingerprint_bits;
+
+    // No column is matched by a length node so the path is empty
+    uint16_t *node_keys = widen_characters(length_chars, num_values);
+    if (!build_slots(node, node_keys, values, payloads, weights, num_values, ctx, NULL, NULL, 0)) {
+        node = NULL;
+    }
+    free(node_keys);
+    free(length_chars);
+    return node;
+}
+
+/**
+ * @brief Orders binaries by length and then by their bytes (for qsort()).
+ *
+ * @param a Pointer to the first binary value.
+ * @param b Pointer to the second binary value.
+ * @return The qsort() order.
+ */
+static int compare_binary_order(const void *a, const void *b) {
+    const BinaryValue *first = (const BinaryValue *)a, *second = (const BinaryValue *)b;
+    if (first->length != second->length) {
+        return first->length < second->length ? -1 : 1;
+    }
+    return first->length ? memcmp(first->binary, second->binary, first->length) : 0;
+}
+
+/**
+ * @brief Checks for duplicate binaries.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @return 1 if there is a duplicate, 0 otherwise.
+ */
+static int has_duplicate_binaries(const BinaryValue *values, size_t num_values) {
+    size_t i;
+    int duplicate = 0;
+    BinaryValue *sorted = (BinaryValue *)malloc(num_values * sizeof(BinaryValue));
+    if (sorted == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    memcpy(sorted, values, num_values * sizeof(BinaryValue));
+    qsort(sorted, num_values, sizeof(BinaryValue), compare_binary_order);
+    for (i = 1; i < num_values && !duplicate; i++) {
+        duplicate = compare_binary_order(&sorted[i - 1], &sorted[i]) == 0;
+    }
+    free(sorted);
+    return duplicate;
+}
+
+static HashNode *build_root_node(BinaryValue *values, Payload *payloads, size_t num_values, const BuildContext *ctx);
+
+/**
+ * @brief Builds a tree within a space budget (ctx->max_bytes).
+ *
+ * Trees are built giving up more lookup speed for space at each step until one fits the budget: the tree as
+ * asked for, then with the smallest node layouts (and wide nodes only where they are smaller), then with buckets
+ * for small groups, and last with each other column scoring policy. The first tree that fits is returned - if
+ * none does the build fails (NULL), as documented for HashBuildOptions max_bytes.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @return Pointer to the root node of the created hash table, NULL for duplicates (or if the depth bound or space
+ * budget can not be met).
+ */
+static HashNode *build_budget_tree(BinaryValue *values, Payload *payloads, size_t num_values, const BuildContext *ctx) {
+    BuildContext attempt = *ctx;
+    HashNode *node;
+    uint8_t scoring;
+
+    attempt.max_bytes = 0;
+    node = build_root_node(values, payloads, num_values, &attempt);
+    if (node == NULL || hash_table_bytes(node) <= ctx->max_bytes) {
+        return node;
+    }
+    discard_tree(ctx, node);
+
+    attempt.compact = 1;
+    node = build_root_node(values, payloads, num_values, &attempt);
+    if (node == NULL || hash_table_bytes(node) <= ctx->max_bytes) {
+        return node;
+    }
+    discard_tree(ctx, node);
+
+    if (!(attempt.flags & HASHNODE_KEYLESS) && attempt.bucket_size < ACPH_MAX_BUCKET_SIZE) {
+        // Buckets tell their binaries apart by the keys - filters and retrieval trees do not keep them
+        attempt.bucket_size = ACPH_MAX_BUCKET_SIZE;
+        node = build_root_node(values, payloads, num_values, &attempt);
+        if (node == NULL || hash_table_bytes(node) <= ctx->max_bytes) {
+            return node;
+        }
+        discard_tree(ctx, node);
+    }
+
+    for (scoring = ACPH_SCORE_MAX_OCCURRENCE; scoring <= ACPH_SCORE_SUM_OF_SQUARES; scoring++) {
+        if (scoring == ctx->column_scoring) {
+            continue; // Already tried
+        }
+        attempt.column_scoring = scoring;
+        node = build_root_node(values, payloads, num_values, &attempt);
+        if (node == NULL || hash_table_bytes(node) <= ctx->max_bytes) {
+            return node;
+        }
+        discard_tree(ctx, node);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Builds the root of a tree - a length node if requested by the build settings, otherwise a column node.
+ *
+ * Under a depth bound the duplicates are found first, so a subtree that fails is over the bound and the builder
+ * can try other nodes for it. If a length node leaves too few levels the tree is built without it. Under a space
+ * budget see build_budget_tree().
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for set nodes).
+ * @param num_values Number of binary values.
+ * @param ctx Build settings.
+ * @return Pointer to the root node of the created hash table, NULL for duplicates (or if the depth bound or space
+ * budget can not be met).
+ */
+static HashNode *build_root_node(BinaryValue *values, Payload *payloads, size_t num_values, const BuildContext *ctx) {
+    if (ctx->max_bytes) {
+        return build_budget_tree(values, payloads, num_values, ctx);
+    }
+    if (ctx->levels && has_duplicate_binaries(values, num_values)) {
+        return NULL;
+    }
+    if (ctx->length_dispatch && num_values > 1 && ctx->levels != 1) {
+        HashNode *node = build_length_node(values, payloads, ctx->weights, num_values, ctx);
+        if (node != NULL || !ctx->levels || build_cancelled(ctx)) {
+            return node;
+        }
+    }
+    return build_binary_node(values, payloads, ctx->weights, num_values, ctx, NULL, NULL, 0);
+}
+
+/**
+ * @brief Sets up the build settings from the build options.
+ *
+ * @param options Pointer to the build options (NULL for the defaults).
+ * @param ctx Pointer to the build settings to set up.
+ * @param progress Pointer to the progress state of the build - it must last as long as the build.
+ * @return 1 if the options are valid, 0 otherwise.
+ */
+static int setup_build_context(const HashBuildOptions *options, BuildContext *ctx, BuildProgress *progress) {
+    HashBuildOptions defaults;
+    if (options == NULL) {
+        init_build_options(&defaults);
+        options = &defaults;
+    }
+    memset(ctx, 0, sizeof(BuildContext));
+    switch (options->mode) {
+        case ACPH_MODE_HASH:
+            break;
+        case ACPH_MODE_SET:
+            ctx->flags = HASHNODE_SET;
+            break;
+        case ACPH_MODE_FILTER:
+            if (options->fingerprint_bits != 8 && options->fingerprint_bits != 16 && options->fingerprint_bits != 32) {
+                return 0;
+            }
+            ctx->flags = HASHNODE_SET | HASHNODE_FILTER;
+            ctx->fingerprint_bits = (uint8_t)options->fingerprint_bits;
+            break;
+        case ACPH_MODE_RETRIEVAL:
+            ctx->flags = HASHNODE_RETRIEVAL;
+            break;
+        default:
+            return 0;
+    }
+    ctx->length_dispatch = options->length_dispatch;
+    ctx->wide_columns = options->wide_columns;
+    if (options->column_scoring != ACPH_SCORE_MAX_OCCURRENCE && options->column_scoring != ACPH_SCORE_ENTROPY &&
+        options->column_scoring != ACPH_SCORE_SUM_OF_SQUARES) {
+        return 0;
+    }
+    ctx->column_scoring = (uint8_t)options->column_scoring;
+    if (options->beam_width < 0 || options->beam_width > ACPH_MAX_BEAM_WIDTH) {
+        return 0;
+    }
+    ctx->beam_width = (uint8_t)options->beam_width;
+    ctx->weights = options->weights;
+    if (options->max_depth < 0) {
+        return 0;
+    }
+    ctx->levels = (size_t)options->max_depth;
+    ctx->max_bytes = options->max_bytes;
+    if (options->effort != ACPH_EFFORT_BALANCED && options->effort != ACPH_EFFORT_FAST &&
+        options->effort != ACPH_EFFORT_THOROUGH) {
+        return 0;
+    }
+    ctx->effort = (uint8_t)options->effort;
+    if (ctx->effort == ACPH_EFFORT_THOROUGH && ctx->beam_width == 0) {
+        ctx->beam_width = THOROUGH_BEAM_WIDTH;
+    }
+    if (options->time_budget < 0) {
+        return 0;
+    }
+    ctx->deadline = options->time_budget > 0 ? build_clock() + options->time_budget : 0;
+    if (options->bucket_size < 0 || options->bucket_size == 1 || options->bucket_size > ACPH_MAX_BUCKET_SIZE) {
+        return 0;
+    }
+    if (!(ctx->flags & HASHNODE_KEYLESS)) {
+        // Buckets tell their binaries apart by the keys - filters and retrieval trees do not keep them
+        ctx->bucket_size = (uint8_t)options->bucket_size;
+    }
+    if (options->threads < 0 || options->threads > ACPH_MAX_THREADS) {
+        return 0;
+    }
+    ctx->threads = (uint8_t)options->threads;
+    ctx->parallel_threshold = options->parallel_threshold;
+    if (options->progress != NULL || options->cancel != NULL) {
+        memset(progress, 0, sizeof(BuildProgress));
+        progress->callback = options->progress;
+        progress->data = options->progress_data;
+        progress->cancel = options->cancel;
+        progress->next_report = PROGRESS_INTERVAL;
+        ctx->progress = progress;
+    }
+    return 1;
+}
+
+/**
+ * @brief Finishes a build - a cancelled build is freed, otherwise the progress callback gets the final counts.
+ *
+ * @param ctx Build settings.
+ * @param node Pointer to the root node of the built tree (NULL if the build failed).
+ * @return Pointer to the root node of the tree, NULL if the build failed or was cancelled.
+ */
+static HashNode *finish_build(const BuildContext *ctx, HashNode *node) {
+    if (node == NULL || ctx->progress == NULL) {
+        return node;
+    }
+    if (build_cancelled(ctx)) {
+        discard_tree(ctx, node);
+        return NULL;
+    }
+    if (ctx->progress->callback != NULL) {
+        ctx->progress->callback(ctx->progress->keys_placed, ctx->progress->nodes_created, ctx->progress->data);
+    }
+    return node;
+}
+
+/**
+ * @brief Initialises build options to the defaults.
+ *
+ * @param options Pointer to the build options.
+ */
+void init_build_options(HashBuildOptions *options) {
+    memset(options, 0, sizeof(HashBuildOptions));
+    options->mode = ACPH_MODE_HASH;
+    options->fingerprint_bits = 16;
+    options->length_dispatch = 0;
+    options->bucket_size = 0;
+    options->wide_columns = 0;
+    options->column_scoring = ACPH_SCORE_MAX_OCCURRENCE;
+    options->beam_width = 0;
+    options->max_depth = 0;
+    options->max_bytes = 0;
+    options->effort = ACPH_EFFORT_BALANCED;
+    options->time_budget = 0;
+    options->progress = NULL;
+    options->progress_data = NULL;
+    options->cancel = NULL;
+    options->threads = 0;
+    options->parallel_threshold = ACPH_PARALLEL_THRESHOLD;
+    options->weights = NULL;
+}
+
+/**
+ * @brief Builds the tree structure recursively from a set of binary buffers.
+ *
+ * This function creates the tree structure for the given binary values and payloads.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_values Number of binary values.
+ * @return Pointer to the root node of the created hash table.
+ */
+HashNode *create_binary_hash(BinaryValue *values, Payload *payloads, size_t num_values) {
+    BuildContext ctx = {0, 0};
+    return build_root_node(values, payloads, num_values, &ctx);
+}
+
+/**
+ * @brief Builds a set (no payloads) from a set of binary buffers.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode *create_binary_set(BinaryValue *values, size_t num_values) {
+    BuildContext ctx = {HASHNODE_SET, 0};
+    return build_root_node(values, NULL, num_values, &ctx);
+}
+
+/**
+ * @brief Builds an approximate membership filter from a set of binary buffers.
+ *
+ * The leaves only keep a fingerprint of each binary (no key bytes), so lookups can return false positives
+ * with a probability of about 2^-fingerprint_bits.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode *create_binary_filter(BinaryValue *values, size_t num_values, int fingerprint_bits) {
+    BuildContext ctx = {HASHNODE_SET | HASHNODE_FILTER, 0};
+    if (fingerprint_bits != 8 && fingerprint_bits != 16 && fingerprint_bits != 32) {
+        return NULL;
+    }
+    ctx.fingerprint_bits = (uint8_t)fingerprint_bits;
+    return build_root_node(values, NULL, num_values, &ctx);
+}
+
+/**
+ * @brief Builds a retrieval only tree from a set of binary buffers.
+ *
+ * No keys are kept and leaves are never verified, so a lookup of a non-member can return an arbitrary payload.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_values Number of binary values.
+ * @return Pointer to the root node of the created tree.
+ */
+HashNode *create_binary_retrieval(BinaryValue *values, Payload *payloads, size_t num_values) {
+    BuildContext ctx = {HASHNODE_RETRIEVAL, 0};
+    return build_root_node(values, payloads, num_values, &ctx);
+}
+
+/**
+ * @brief Builds a tree from a set of binary buffers with build options.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for sets and filters).
+ * @param num_values Number of binary values.
+ * @param options Pointer to the build options (NULL for the defaults).
+ * @return Pointer to the root node of the created tree, NULL for duplicates or invalid options.
+ */
+HashNode *create_binary_hash_ex(BinaryValue *values, Payload *payloads, size_t num_values, const HashBuildOptions *options) {
+    BuildContext ctx;
+    BuildProgress progress;
+    if (!setup_build_context(options, &ctx, &progress)) {
+        return NULL;
+    }
+    return finish_build(&ctx, build_root_node(values, payloads, num_values, &ctx));
+}
+
+/**
+ * @brief Compares two binary values.
+ *
+ * This function compares two binary values and returns 1 if they are equal, 0 otherwise.
+ *
+ * @param str1 Pointer to the first binary value.
+ * @param str2 Pointer to the second binary value.
+ * @return 1 if the binary values are equal, 0 otherwise.
+ */
+int compare_binaries(const BinaryValue *str1, const BinaryValue *str2) {
+    if (str1->length != str2->length) {
+        return 0;
+    }
+    return memcmp(str1->binary, str2->binary, str1->length) == 0;
+}
+
+/**
+ * @brief Compares a binary with a leaf.
+ *
+ * Only the bytes in the leaf's verify range are compared, the rest were matched on the path to the leaf.
+ *
+ * @param str Pointer to the binary value.
+ * @param leaf Pointer to the leaf.
+ * @return 1 if the binary values are equal, 0 otherwise.
+ */
+static int compare_leaf(const BinaryValue *str, const LeafValue *leaf) {
+    if (str->length != leaf->value.length) {
+        return 0;
+    }
+    return memcmp(str->binary + leaf->verify_start, leaf->value.binary + leaf->verify_start,
+                  leaf->verify_end - leaf->verify_start) == 0;
+}
+
+/**
+ * @brief Checks a binary against a leaf slot.
+ *
+ * @param str Pointer to the binary value.
+ * @param node Pointer to the node holding the leaf.
+ * @param slot Pointer to the leaf slot.
+ * @param payload_out Pointer to the payload to be set if the binary is found.
+ * @return 1 if found (and sets payload), 0 otherwise.
+ */
+static int lookup_leaf(const BinaryValue *str, const HashNode *node, const HashSlot *slot, Payload *payload_out) {
+    if (node->flags & HASHNODE_RETRIEVAL) {
+        // Retrieval leaf, the binary is assumed to be a member so there is nothing to verify
+        copy_payload(node, slot, payload_out);
+        return 1;
+    }
+    if (node->flags & HASHNODE_FILTER) {
+        // Filter leaf, compare the fingerprints (may give a false positive)
+        if (binary_fingerprint(str, node->fingerprint_bits) == slot->next_node.fingerprint) {
+            copy_payload(node, slot, payload_out);
+            return 1;
+        }
+        return 0;
+    }
+    // Leaf node, reject on the length and fingerprint in the slot before reading the stored binary
+    if (slot->leaf_length != LEAF_LENGTH(str->length) || slot->leaf_fingerprint != leaf_fingerprint(str)) {
+        return 0;
+    }
+    // Compare with the stored binary - only the bytes not matched on the path
+    if (compare_leaf(str, slot->next_node.leaf)) {
+        copy_payload(node, slot, payload_out);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the slots of a bucket node that could hold a binary with the given leaf fingerprint.
+ *
+ * Every slot's fingerprint is compared at once: the packed fingerprints are XORed with the fingerprint repeated
+ * in each byte, and the bytes that become zero are flagged. A borrow can also flag the byte above a match, so
+ * each candidate still has to be verified.
+ *
+ * @param node Pointer to the bucket node.
+ * @param fingerprint The leaf fingerprint.
+ * @return Bit 7 of byte i set for each candidate slot i.
+ */
+static uint32_t bucket_matches(const HashNode *node, uint8_t fingerprint) {
+    uint32_t x = BUCKET_FINGERPRINTS(node) ^ (fingerprint * 0x01010101u);
+    uint32_t slots = 0x80808080u >> (8 * (ACPH_MAX_BUCKET_SIZE - 1 - node->num_slots));
+    return (x - 0x01010101u) & ~x & slots;
+}
+
+/**
+ * @brief Looks up a binary in a bucket node.
+ *
+ * @param str Pointer to the binary value.
+ * @param node Pointer to the bucket node.
+ * @param payload_out Pointer to the payload to be set if the binary is found.
+ * @return 1 if found (and sets payload), 0 otherwise.
+ */
+static int lookup_bucket(const BinaryValue *str, const HashNode *node, Payload *payload_out) {
+    uint32_t matches = bucket_matches(node, leaf_fingerprint(str));
+    int i;
+    for (i = 0; matches; i++, matches >>= 8) {
+        if (matches & 0x80) {
+            const HashSlot *slot = HASHNODE_SLOT(node, i);
+            if (slot->leaf_length == LEAF_LENGTH(str->length) && compare_leaf(str, slot->next_node.leaf)) {
+                copy_payload(node, slot, payload_out);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the character (or 16 bit key for wide nodes) that a node hashes for a binary.
+ *
+ * @param str Pointer to the binary value.
+ * @param node Pointer to the node (not a bucket).
+ * @return The node's character for the binary.
+ */
+static unsigned int node_character(const BinaryValue *str, const HashNode *node) {
+    if (node->kind == HASHNODE_LENGTH) {
+        return LENGTH_BUCKET(str->length);
+    }
+    if (node->kind == HASHNODE_COLUMN16) {
+        return WIDE_KEY(column_character(str, node->column), column_character(str, node->column + 1));
+    }
+    if (node->kind == HASHNODE_PAIR) {
+        return PAIR_CHARACTER(column_character(str, node->column), column_character(str, PAIR_COLUMN(node)));
+    }
+    return column_character(str, node->column);
+}
+
+/**
+ * @brief Compares a binary against the tree structure.
+ *
+ * This function looks up a binary value in the hash node and returns 1 if found (and sets payload), 0 otherwise.
+ *
+ * @param str Pointer to the binary value to compare.
+ * @param node Pointer to the root node of the hash table.
+ * @param payload_out Pointer to the payload to be set if the binary is found.
+ * @return 1 if found (and sets payload), 0 otherwise.
  */
 int lookup_binary(const BinaryValue *str, const HashNode  *node, Payload *payload_out) { // NOLINT
 
-    // Create hash value for the binary
-    uint8_t character;
-    size_t effective_column = node->column;
-    if (effective_column >= str->length) {
-        character = 0;
+    // Create hash value for the binary (a 16 bit key for wide nodes)
+    unsigned int character;
+    if (node->kind == HASHNODE_BUCKET) {
+        return lookup_bucket(str, node, payload_out);
+    }
+    character = node_character(str, node);
+    const HashSlot *slot = node_slot(node, character);
+
+    if (slot == NULL || slot->count == 0 || slot->character != (uint8_t)character) {
+        return 0; // No match - the column is matched here so the leaf need not compare it again
+    }
+    else if (slot->count == 1) {
+        return lookup_leaf(str, node, slot, payload_out);
+    }
+    else {
+        // Traverse to the child node
+        return lookup_binary(str, slot->next_node.child, payload_out);
+    }
+}
+
+/**
+ * @brief Returns the number of nodes visited to look up a binary.
+ *
+ * @param str Pointer to the binary value.
+ * @param node Pointer to the root node of the tree.
+ * @return The number of nodes visited - to the binary's leaf, or to the node that rejects it.
+ */
+size_t lookup_binary_depth(const BinaryValue *str, const HashNode *node) {
+    size_t depth = 1;
+    for (;;) {
+        const HashSlot *slot;
+        unsigned int character;
+        if (node->kind == HASHNODE_BUCKET) {
+            return depth;
+        }
+        character = node_character(str, node);
+        slot = node_slot(node, character);
+        if (slot == NULL || slot->count <= 1 || slot->character != (uint8_t)character) {
+            return depth;
+        }
+        node = slot->next_node.child;
+        depth++;
+    }
+}
+
+/**
+ * @brief Frees the tree structure.
+ *
+ * This function recursively frees the memory allocated for the hash table tree structure.
+ *
+ * @param node Pointer to the root node of the tree.
+ */
+void free_tree(HashNode *node) { // NOLINT
+    int i;
+    if (node == NULL) {
+        return;
+    }
+    if (node->flags & HASHNODE_PACKED) {
+        // A packed tree is one buffer that starts with the root
+        free(node);
+        return;
+    }
+
+    for (i = 0; i < HASHNODE_SLOT_COUNT(node); i++) {
+        HashSlot *slot = HASHNODE_SLOT(node, i);
+        if (slot->count > 1) {
+            free_tree(slot->next_node.child);
+        }
+        else if (slot->count == 1 && !(node->flags & HASHNODE_KEYLESS)) {
+            free(slot->next_node.leaf);
+        }
+    }
+    free(node);
+}
+
+// A node or a leaf (with its key) of a tree being packed by relayout_tree()
+typedef struct PackItem {
+    const HashNode *node; // The node - or the node holding the leaf
+    size_t slot;          // The slot of the leaf (PACK_NODE for a node)
+    size_t slot_base;     // Index of the node's first slot in the slot_item array (nodes only)
+    size_t hits;          // Number of lookups in the trace that reached the item
+    size_t size;          // Bytes of the item in the buffer (a multiple of 8)
+    size_t offset;        // Offset of the item in the buffer
+} PackItem;
+
+// PackItem slot for a node, and slot_item entry for an empty slot
+#define PACK_NODE ((size_t)-1)
+
+// Rounds a size up to 8 bytes so that every item in the packed buffer is aligned
+#define PACK_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Items of a tree being packed, and the item of each node slot (a child node or a leaf)
+typedef struct PackList {
+    PackItem *items;
+    size_t num_items;
+    size_t *slot_item;
+    size_t num_slots;
+} PackList;
+
+/**
+ * @brief Returns the number of bytes allocated for a node (including the second column of a pair node).
+ *
+ * @param node Pointer to the node.
+ * @return The bytes of the node.
+ */
+static size_t node_alloc_bytes(const HashNode *node) {
+    return HASHNODE_BYTES(node) + (node->kind == HASHNODE_PAIR ? sizeof(size_t) : 0);
+}
+
+/**
+ * @brief Adds an item to the pack list.
+ *
+ * @param list Pointer to the pack list.
+ * @param node The node (or the node holding the leaf).
+ * @param slot The slot of the leaf (PACK_NODE for a node).
+ * @param size Bytes of the item.
+ * @return Index of the item.
+ */
+static size_t add_pack_item(PackList *list, const HashNode *node, size_t slot, size_t size) {
+    PackItem *item;
+    if ((list->num_items & (list->num_items - 1)) == 0) {
+        // Grow at powers of two
+        list->items = (PackItem *)realloc(list->items, (list->num_items ? list->num_items * 2 : 1) * sizeof(PackItem));
+        if (list->items == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+    }
+    item = &list->items[list->num_items];
+    item->node = node;
+    item->slot = slot;
+    item->slot_base = 0;
+    item->hits = 0;
+    item->size = PACK_ALIGN(size);
+    item->offset = 0;
+    return list->num_items++;
+}
+
+/**
+ * @brief Lists the nodes and leaves of a tree (depth first) for relayout_tree().
+ *
+ * @param list Pointer to the pack list.
+ * @param node Pointer to the node.
+ * @return Index of the node's item.
+ */
+static size_t list_pack_items(PackList *list, const HashNode *node) { // NOLINT
+    size_t i, slot_base, item;
+    size_t num_node_slots = HASHNODE_SLOT_COUNT(node);
+
+    item = add_pack_item(list, node, PACK_NODE, node_alloc_bytes(node));
+    slot_base = list->num_slots;
+    list->items[item].slot_base = slot_base;
+    list->num_slots += num_node_slots;
+    list->slot_item = (size_t *)realloc(list->slot_item, list->num_slots * sizeof(size_t));
+    if (list->slot_item == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < num_node_slots; i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
+        size_t slot_item = PACK_NODE;
+        if (slot->count > 1) {
+            slot_item = list_pack_items(list, slot->next_node.child);
+        }
+        else if (slot->count == 1 && !(node->flags & HASHNODE_KEYLESS) && slot->next_node.leaf != NULL) {
+            // The leaf and its key are kept together
+            slot_item = add_pack_item(list, node, i, PACK_ALIGN(sizeof(LeafValue)) + slot->next_node.leaf->value.length);
+        }
+        list->slot_item[slot_base + i] = slot_item;
+    }
+    return item;
+}
+
+/**
+ * @brief Counts the hits of a lookup on the items of a tree for relayout_tree().
+ *
+ * @param list Pointer to the pack list (the root is item 0).
+ * @param str Pointer to the looked up binary.
+ */
+static void count_pack_hits(PackList *list, const BinaryValue *str) {
+    const HashNode *node = list->items[0].node;
+    size_t item = 0;
+    for (;;) {
+        const HashSlot *slot;
+        unsigned int character;
+        size_t i;
+        list->items[item].hits++;
+        if (node->kind == HASHNODE_BUCKET) {
+            // The leaves whose fingerprints match are read
+            uint32_t matches = bucket_matches(node, leaf_fingerprint(str));
+            for (i = 0; matches; i++, matches >>= 8) {
+                if ((matches & 0x80) && list->slot_item[list->items[item].slot_base + i] != PACK_NODE) {
+                    list->items[list->slot_item[list->items[item].slot_base + i]].hits++;
+                }
+            }
+            return;
+        }
+        character = node_character(str, node);
+        slot = node_slot(node, character);
+        if (slot == NULL || slot->count == 0 || slot->character != (uint8_t)character) {
+            return;
+        }
+        i = ((const uint8_t *)slot - (const uint8_t *)HASHNODE_SLOT(node, 0)) / HASHSLOT_SIZE(node->flags);
+        item = list->slot_item[list->items[item].slot_base + i];
+        if (item == PACK_NODE) {
+            return; // A leaf with nothing stored
+        }
+        if (slot->count == 1) {
+            list->items[item].hits++;
+            return;
+        }
+        node = slot->next_node.child;
+    }
+}
+
+// A pack item to be sorted - self contained, as qsort() has no context argument and relayouts can run at once
+typedef struct PackOrder {
+    size_t hits; // Hits of the item
+    size_t item; // Index of the item in the PackList (its depth first order)
+} PackOrder;
+
+/**
+ * @brief Orders pack items by hits, most first, and then by their depth first order.
+ *
+ * @param a Pointer to the first PackOrder.
+ * @param b Pointer to the second PackOrder.
+ * @return The qsort() order.
+ */
+static int compare_pack_items(const void *a, const void *b) {
+    const PackOrder *first = (const PackOrder *)a, *second = (const PackOrder *)b;
+    if (first->hits != second->hits) {
+        return first->hits > second->hits ? -1 : 1;
+    }
+    return first->item < second->item ? -1 : (first->item > second->item ? 1 : 0);
+}
+
+/**
+ * @brief Copies a tree into one packed buffer laid out for a lookup trace.
+ *
+ * The nodes and leaves (each leaf with a copy of its key) are placed in the order of the number of lookups in the
+ * trace that reach them - the root first and the items no lookup reached at the end - so the lookups of hot keys
+ * share cache lines and pages. The copy does not point into the original tree or the keys it was built from.
+ * The original tree is only read, so this can run on another thread while it serves lookups, and the copy is
+ * then swapped in for it.
+ *
+ * @param node Pointer to the root node of the tree.
+ * @param trace Pointer to the array of looked up binaries (NULL for none - the depth first order is kept).
+ * @param trace_length Number of binaries in the trace.
+ * @return Pointer to the root node of the packed copy (free it with free_tree()), NULL for an empty tree.
+ */
+HashNode *relayout_tree(const HashNode *node, const BinaryValue *trace, size_t trace_length) {
+    PackList list;
+    PackOrder *order;
+    size_t i, j, offset;
+    uint8_t *buffer;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    memset(&list, 0, sizeof(list));
+    list_pack_items(&list, node);
+    for (i = 0; i < trace_length; i++) {
+        count_pack_hits(&list, &trace[i]);
+    }
+
+    // Order by hits - the root has the most (every lookup) and is first on ties, so it stays at the start
+    order = (PackOrder *)malloc(list.num_items * sizeof(PackOrder));
+    if (order == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
     }
-    else {
-        character = str->binary[effective_column];
+    for (i = 0; i < list.num_items; i++) {
+        order[i].hits = list.items[i].hits;
+        order[i].item = i;
     }
-    int slot = hash_function(character, node->prime, node->num_slots);
+    qsort(order, list.num_items, sizeof(PackOrder), compare_pack_items);
+    offset = 0;
+    for (i = 0; i < list.num_items; i++) {
+        list.items[order[i].item].offset = offset;
+        offset += list.items[order[i].item].size;
+    }
+    free(order);
 
-    if (node->slot[slot].count == 0) {
-        return 0; // No match
+    buffer = (uint8_t *)malloc(offset);
+    if (buffer == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
     }
-    else if (node->slot[slot].count == 1) {
-        // Leaf node, compare with the stored binary
-        if (compare_binaries(str, node->slot[slot].next_node.binary)) {
-            if (payload_out != NULL) {
-                *payload_out = node->slot[slot].payload;
+    for (i = 0; i < list.num_items; i++) {
+        const PackItem *item = &list.items[i];
+        if (item->slot == PACK_NODE) {
+            HashNode *copy = (HashNode *)(buffer + item->offset);
+            memcpy(copy, item->node, node_alloc_bytes(item->node));
+            copy->flags |= HASHNODE_PACKED;
+            for (j = 0; j < HASHNODE_SLOT_COUNT(copy); j++) {
+                HashSlot *slot = HASHNODE_SLOT(copy, j);
+                size_t slot_item = list.slot_item[item->slot_base + j];
+                if (slot_item == PACK_NODE) {
+                    continue;
+                }
+                if (slot->count > 1) {
+                    slot->next_node.child = (HashNode *)(buffer + list.items[slot_item].offset);
+                }
+                else {
+                    slot->next_node.leaf = (LeafValue *)(buffer + list.items[slot_item].offset);
+                }
             }
-            return 1;
         }
         else {
-            return 0;
+            // The leaf followed by its key
+            const LeafValue *leaf = HASHNODE_SLOT(item->node, item->slot)->next_node.leaf;
+            LeafValue *copy = (LeafValue *)(buffer + item->offset);
+            *copy = *leaf;
+            copy->value.binary = buffer + item->offset + PACK_ALIGN(sizeof(LeafValue));
+            memcpy(copy->value.binary, leaf->value.binary, leaf->value.length);
         }
     }
-    else {
-        // Traverse to the child node
-        return lookup_binary(str, node->slot[slot].next_node.child, payload_out);
-    }
+    free(list.items);
+    free(list.slot_item);
+    return (HashNode *)buffer;
 }
 
 /**
- * @brief Frees the tree structure.
- *
- * This function recursively frees the memory allocated for the hash table tree structure.
+ * @brief Finds the 16 bit key of a slot of a wide node (from the bitmap as the slot only has 8 bits for it).
  *
- * @param node Pointer to the root node of the tree.
+ * @param node Pointer to the wide node.
+ * @param slot Slot number.
+ * @return The key.
  */
-void free_tree(HashNode *node) { // NOLINT
-    int i;
-    if (node == NULL) {
-        return;
-    }
-
-    for (i = 0; i <= node->num_slots; i++) {
-        if (node->slot[i].count > 1) {
-            free_tree(node->slot[i].next_node.child);
-        }
-        else if (node->slot[i].count == 1) {
-            free(node->slot[i].next_node.binary);
+static unsigned int wide_slot_key(const HashNode *node, size_t slot) {
+    const WideBitmap *bitmap = (const WideBitmap *)HASHNODE_KEYS(node);
+    unsigned int key;
+    for (key = 0; key < 65536; key++) {
+        if (bitmap->bits[key >> 6] & ((uint64_t)1 << (key & 63))) {
+            if (slot-- == 0) {
+                break;
+            }
         }
     }
-    free(node);
+    return key;
 }
 
 /**
@@ -557,33 +3500,79 @@ void print_tree(HashNode *node, int level, print_leaf_func print_leaf) { // NOLI
     for (j = 0; j < level; j++) {
         printf("   ");
     }
-    printf("Slots %d, Column: %d, Prime: %d\n", node->num_slots, (int)node->column, node->prime);
+    if (node->kind == HASHNODE_BUCKET) {
+        printf("Slots %d, Bucket\n", node->num_slots);
+    }
+    else {
+        if (node->kind == HASHNODE_LENGTH) {
+            printf("Slots %d, Length, ", node->num_slots);
+        }
+        else if (node->kind == HASHNODE_COLUMN16) {
+            printf("Slots %d, Columns: %d-%d, ", (int)HASHNODE_SLOT_COUNT(node) - 1, (int)node->column, (int)node->column + 1);
+        }
+        else if (node->kind == HASHNODE_PAIR) {
+            printf("Slots %d, Columns: %d^%d, ", node->num_slots, (int)node->column, (int)PAIR_COLUMN(node));
+        }
+        else {
+            printf("Slots %d, Column: %d, ", node->num_slots, (int)node->column);
+        }
+        switch (node->layout) {
+            case HASHNODE_LINEAR:
+                printf("Linear\n");
+                break;
+            case HASHNODE_SEARCH16:
+                printf("Search16\n");
+                break;
+            case HASHNODE_BITMAP:
+                printf("Bitmap\n");
+                break;
+            case HASHNODE_BITMAP16:
+                printf("Bitmap16\n");
+                break;
+            default:
+                printf("Prime: %d\n", node->prime);
+        }
+    }
     // Print Slots
-    for (i = 0; i <= node->num_slots; i++) {
+    for (i = 0; i < (int)HASHNODE_SLOT_COUNT(node); i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
         for (j = 0; j < level; j++) {
             printf("   ");
         }
-        if (node->slot[i].count == 0) {
+        if (slot->count == 0) {
             printf("Slot %d: Empty\n", i);
         }
-        else if (node->slot[i].count == 1) {
+        else if (node->kind == HASHNODE_COLUMN16) {
+            printf("Slot %d: 0x%04x ->%s", i, wide_slot_key(node, i), slot->count == 1 ? " " : "\n");
+            if (slot->count == 1) {
+                print_leaf(node, i);
+                printf("\n");
+            }
+            else {
+                print_tree(slot->next_node.child, level + 1, print_leaf);
+            }
+        }
+        else if (slot->count == 1) {
 
-            if (node->slot[i].character < 32 || node->slot[i].character > 126) {
-                printf("Slot %d: 0x%02x -> ", i, node->slot[i].character);
+            if (node->kind == HASHNODE_BUCKET) {
+                printf("Slot %d: -> ", i);
+            }
+            else if (slot->character < 32 || slot->character > 126) {
+                printf("Slot %d: 0x%02x -> ", i, slot->character);
             } else {
-                printf("Slot %d: 0x%02x ('%c') -> ", i, node->slot[i].character, node->slot[i].character);
+                printf("Slot %d: 0x%02x ('%c') -> ", i, slot->character, slot->character);
             }
             print_leaf(node, i);
             printf("\n");
         }
         else {
-            if (node->slot[i].character < 32 || node->slot[i].character > 126) {
-                printf("Slot %d: 0x%02x ->\n", i, node->slot[i].character);
+            if (slot->character < 32 || slot->character > 126) {
+                printf("Slot %d: 0x%02x ->\n", i, slot->character);
             }
             else {
-                printf("Slot %d: 0x%02x ('%c') ->\n", i, node->slot[i].character, node->slot[i].character);
+                printf("Slot %d: 0x%02x ('%c') ->\n", i, slot->character, slot->character);
             }
-            print_tree(node->slot[i].next_node.child, level + 1, print_leaf);
+            print_tree(slot->next_node.child, level + 1, print_leaf);
         }
     }
 }
@@ -595,7 +3584,7 @@ void print_tree(HashNode *node, int level, print_leaf_func print_leaf) { // NOLI
  * @param slot Slot index in the hash table.
  */
 void print_string_leaf(const HashNode *node, int slot) {
-    printf("'%.*s'", (int)node->slot[slot].next_node.binary->length, node->slot[slot].next_node.binary->binary);
+    printf("'%.*s'", (int)HASHNODE_SLOT(node, slot)->next_node.leaf->value.length, HASHNODE_SLOT(node, slot)->next_node.leaf->value.binary);
 }
 
 /**
@@ -606,7 +3595,7 @@ void print_string_leaf(const HashNode *node, int slot) {
  */
 void print_int_leaf(const HashNode *node, int slot) {
     int64_t integer;
-    integer = *(int64_t *)node->slot[slot].next_node.binary->binary;
+    integer = *(int64_t *)HASHNODE_SLOT(node, slot)->next_node.leaf->value.binary;
     printf("%lld", integer);
 }
 
@@ -618,7 +3607,7 @@ void print_int_leaf(const HashNode *node, int slot) {
  */
 void print_double_leaf(const HashNode *node, int slot) {
     double real;
-    real = *(double *)node->slot[slot].next_node.binary->binary;
+    real = *(double *)HASHNODE_SLOT(node, slot)->next_node.leaf->value.binary;
     printf("%f", real);
 }
 
@@ -630,10 +3619,10 @@ void print_double_leaf(const HashNode *node, int slot) {
  */
 void print_char_leaf(const HashNode *node, int slot) {
     // Print the character as a character if it is printable
-    if (node->slot[slot].character < 32 || node->slot[slot].character > 126) {
-        printf("0x%02x", node->slot[slot].character);
+    if (HASHNODE_SLOT(node, slot)->character < 32 || HASHNODE_SLOT(node, slot)->character > 126) {
+        printf("0x%02x", HASHNODE_SLOT(node, slot)->character);
     } else {
-        printf("%c", (uint8_t)node->slot[slot].character);
+        printf("%c", (uint8_t)HASHNODE_SLOT(node, slot)->character);
     }
 }
 
@@ -646,23 +3635,44 @@ void print_char_leaf(const HashNode *node, int slot) {
 void print_binary_leaf(const HashNode *node, int slot) {
     int i;
     printf("0x");
-    for (i = 0; i < 20 && i < node->slot[slot].next_node.binary->length; i++) {
-        printf("%02x", (uint8_t)node->slot[slot].next_node.binary->binary[i]);
+    for (i = 0; i < 20 && i < HASHNODE_SLOT(node, slot)->next_node.leaf->value.length; i++) {
+        printf("%02x", (uint8_t)HASHNODE_SLOT(node, slot)->next_node.leaf->value.binary[i]);
     }
-    if (node->slot[slot].next_node.binary->length > 20) {
+    if (HASHNODE_SLOT(node, slot)->next_node.leaf->value.length > 20) {
         printf("...");
     }
 }
 
 /**
- * @brief Creates a hash table for a set of null-terminated strings.
+ * @brief Helper function to print a filter leaf node - the fingerprint in hex.
+ *
+ * @param node Pointer to the hash node.
+ * @param slot Slot index in the hash table.
+ */
+void print_fingerprint_leaf(const HashNode *node, int slot) {
+    printf("fingerprint 0x%0*x", node->fingerprint_bits / 4, (unsigned int)HASHNODE_SLOT(node, slot)->next_node.fingerprint);
+}
+
+/**
+ * @brief Helper function to print a retrieval leaf node - the payload as an integer.
+ *
+ * @param node Pointer to the hash node.
+ * @param slot Slot index in the hash table.
+ */
+void print_payload_leaf(const HashNode *node, int slot) {
+    printf("payload %lld", (long long)HASHNODE_SLOT(node, slot)->payload.integer);
+}
+
+/**
+ * @brief Builds a tree for a set of null-terminated strings.
  *
  * @param strings Pointer to the array of strings.
- * @param payloads Pointer to the array of payloads.
+ * @param payloads Pointer to the array of payloads (ignored for sets).
  * @param num_strings Number of strings.
+ * @param ctx Build settings.
  * @return Pointer to the root node of the created hash table.
  */
-HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_strings) {
+static HashNode* build_string_node(uint8_t **strings, Payload *payloads, size_t num_strings, const BuildContext *ctx) {
     // Convert the strings to binary values
     BinaryValue *values = malloc(num_strings * sizeof(BinaryValue));
     if (values == NULL) {
@@ -675,11 +3685,145 @@ HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_st
         values[i].binary = strings[i];
         values[i].length = strlen((char*)strings[i]);
     }
-    HashNode *hash = create_binary_hash(values, payloads, num_strings);
+    HashNode *hash = build_root_node(values, payloads, num_strings, ctx);
     free(values);
     return hash;
 }
 
+/**
+ * @brief Creates a hash table for a set of null-terminated strings.
+ *
+ * @param strings Pointer to the array of strings.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_strings Number of strings.
+ * @return Pointer to the root node of the created hash table.
+ */
+HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_strings) {
+    BuildContext ctx = {0, 0};
+    return build_string_node(strings, payloads, num_strings, &ctx);
+}
+
+/**
+ * @brief Creates a set (no payloads) for a set of null-terminated strings.
+ *
+ * @param strings Pointer to the array of strings.
+ * @param num_strings Number of strings.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_string_set(uint8_t **strings, size_t num_strings) {
+    BuildContext ctx = {HASHNODE_SET, 0};
+    return build_string_node(strings, NULL, num_strings, &ctx);
+}
+
+/**
+ * @brief Creates an approximate membership filter for a set of null-terminated strings.
+ *
+ * @param strings Pointer to the array of strings.
+ * @param num_strings Number of strings.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_string_filter(uint8_t **strings, size_t num_strings, int fingerprint_bits) {
+    BuildContext ctx = {HASHNODE_SET | HASHNODE_FILTER, 0};
+    if (fingerprint_bits != 8 && fingerprint_bits != 16 && fingerprint_bits != 32) {
+        return NULL;
+    }
+    ctx.fingerprint_bits = (uint8_t)fingerprint_bits;
+    return build_string_node(strings, NULL, num_strings, &ctx);
+}
+
+/**
+ * @brief Creates a retrieval only tree for a set of null-terminated strings - see create_binary_retrieval().
+ *
+ * @param strings Pointer to the array of strings.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_strings Number of strings.
+ * @return Pointer to the root node of the created tree.
+ */
+HashNode* create_string_retrieval(uint8_t **strings, Payload *payloads, size_t num_strings) {
+    BuildContext ctx = {HASHNODE_RETRIEVAL, 0};
+    return build_string_node(strings, payloads, num_strings, &ctx);
+}
+
+/**
+ * @brief Creates a tree for a set of null-terminated strings with build options.
+ *
+ * @param strings Pointer to the array of strings.
+ * @param payloads Pointer to the array of payloads (ignored for sets and filters).
+ * @param num_strings Number of strings.
+ * @param options Pointer to the build options (NULL for the defaults).
+ * @return Pointer to the root node of the created tree, NULL for duplicates or invalid options.
+ */
+HashNode* create_string_hash_ex(uint8_t **strings, Payload *payloads, size_t num_strings, const HashBuildOptions *options) {
+    BuildContext ctx;
+    BuildProgress progress;
+    if (!setup_build_context(options, &ctx, &progress)) {
+        return NULL;
+    }
+    return finish_build(&ctx, build_string_node(strings, payloads, num_strings, &ctx));
+}
+
+// Bytes scanned past a column when a string cursor needs to scan - so deeper columns rarely need another scan
+#define STRING_SCAN_AHEAD 64
+// string_scan() limit to scan to the end of the string
+#define STRING_SCAN_ALL ((size_t)-1)
+
+// Cursor over a null-terminated string that finds the length lazily
+typedef struct StringCursor {
+    const uint8_t *str; // The string
+    size_t scanned;     // Number of bytes known not to be the terminator
+    int ended;          // Set when the terminator has been found (at str[scanned])
+} StringCursor;
+
+/**
+ * @brief Scans a string for the terminator, up to a limit.
+ *
+ * Afterwards scanned is the string length if the terminator was found, otherwise the limit.
+ *
+ * @param cursor Pointer to the string cursor.
+ * @param limit Number of bytes to scan up to (STRING_SCAN_ALL for the whole string).
+ */
+static void string_scan(StringCursor *cursor, size_t limit) {
+    const uint8_t *end;
+    if (cursor->ended || cursor->scanned >= limit) {
+        return;
+    }
+    if (limit == STRING_SCAN_ALL) {
+        // strlen() - a memchr() length near SIZE_MAX runs far past the end of the string, which C90 does not allow
+        // (and some memchr() versions get wrong)
+        cursor->scanned += strlen((const char *)cursor->str + cursor->scanned);
+        cursor->ended = 1;
+        return;
+    }
+    // The lookahead limits are short - memchr() stops at the first match, so it does not read past the terminator
+    end = memchr(cursor->str + cursor->scanned, 0, limit - cursor->scanned);
+    if (end != NULL) {
+        cursor->scanned = end - cursor->str;
+        cursor->ended = 1;
+    }
+    else {
+        cursor->scanned = limit;
+    }
+}
+
+/**
+ * @brief Returns the byte of a string at a column - columns past the end of the string read as 0.
+ *
+ * @param cursor Pointer to the string cursor.
+ * @param column Column position.
+ * @return The byte at the column or 0.
+ */
+static uint8_t string_column_character(StringCursor *cursor, size_t column) {
+    if (column >= cursor->scanned) {
+        string_scan(cursor, column + STRING_SCAN_AHEAD);
+    }
+    if (column >= cursor->scanned && cursor->ended) {
+        return 0;
+    }
+    // Either before the end or the next byte to scan (which may be the terminator)
+    return cursor->str[column];
+}
+
 /**
  * @brief Looks up a string in the hash node.
  *
@@ -689,21 +3833,78 @@ HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_st
  * @return 1 if found (and sets payload), 0 otherwise.
  */
 int lookup_string(const uint8_t *str, const HashNode *node, Payload *payload_out) {
+    StringCursor cursor;
     BinaryValue value;
-    value.binary = (uint8_t*)str;
-    value.length = strlen((char*)str);
-    return lookup_binary(&value, node, payload_out);
+    cursor.str = str;
+    cursor.scanned = 0;
+    cursor.ended = 0;
+
+    for (;;) {
+        // Create hash value for the string - only reading as far as the column
+        unsigned int character;
+        if (node->kind == HASHNODE_BUCKET) {
+            // Bucket - the leaf fingerprints are of the whole string
+            string_scan(&cursor, STRING_SCAN_ALL);
+            value.binary = (uint8_t*)str;
+            value.length = cursor.scanned;
+            return lookup_bucket(&value, node, payload_out);
+        }
+        if (node->kind == HASHNODE_LENGTH) {
+            string_scan(&cursor, 255);
+            character = LENGTH_BUCKET(cursor.scanned);
+        }
+        else if (node->kind == HASHNODE_COLUMN16) {
+            character = string_column_character(&cursor, node->column);
+            character = WIDE_KEY(character, string_column_character(&cursor, node->column + 1));
+        }
+        else if (node->kind == HASHNODE_PAIR) {
+            character = string_column_character(&cursor, node->column);
+            character = PAIR_CHARACTER(character, string_column_character(&cursor, PAIR_COLUMN(node)));
+        }
+        else {
+            character = string_column_character(&cursor, node->column);
+        }
+        const HashSlot *slot = node_slot(node, character);
+
+        if (slot == NULL || slot->count == 0 || slot->character != (uint8_t)character) {
+            return 0; // No match
+        }
+        if (slot->count > 1) {
+            // Traverse to the child node
+            node = slot->next_node.child;
+            continue;
+        }
+
+        // Leaf - find the string length, but for a stored binary of known length only read one byte past it
+        value.binary = (uint8_t*)str;
+        if (node->flags & HASHNODE_RETRIEVAL) {
+            value.length = 0; // Not used
+        }
+        else if (!(node->flags & HASHNODE_FILTER) && slot->leaf_length != LEAF_LENGTH_LONG) {
+            string_scan(&cursor, (size_t)slot->leaf_length + 1);
+            if (cursor.scanned != slot->leaf_length) {
+                return 0; // The string is shorter or longer than the stored binary
+            }
+            value.length = cursor.scanned;
+        }
+        else {
+            string_scan(&cursor, STRING_SCAN_ALL);
+            value.length = cursor.scanned;
+        }
+        return lookup_leaf(&value, node, slot, payload_out);
+    }
 }
 
 /**
- * @brief Creates a hash table for a set of integers.
+ * @brief Builds a tree for a set of integers.
  *
  * @param integers Pointer to the array of integers.
- * @param payloads Pointer to the array of payloads.
+ * @param payloads Pointer to the array of payloads (ignored for sets).
  * @param num_integers Number of integers.
+ * @param ctx Build settings.
  * @return Pointer to the root node of the created hash table.
  */
-HashNode* create_integer_hash(int64_t *integers, Payload *payloads, size_t num_integers) {
+static HashNode* build_integer_node(int64_t *integers, Payload *payloads, size_t num_integers, const BuildContext *ctx) {
     // Convert the integers to binary values
     BinaryValue *values = malloc(num_integers * sizeof(BinaryValue));
     if (values == NULL) {
@@ -716,11 +3917,66 @@ HashNode* create_integer_hash(int64_t *integers, Payload *payloads, size_t num_i
         values[i].binary = (uint8_t*)&integers[i];
         values[i].length = sizeof(integers[i]);
     }
-    HashNode *hash = create_binary_hash(values, payloads, num_integers);
+    HashNode *hash = build_root_node(values, payloads, num_integers, ctx);
     free(values);
     return hash;
 }
 
+/**
+ * @brief Creates a hash table for a set of integers.
+ *
+ * @param integers Pointer to the array of integers.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_integers Number of integers.
+ * @return Pointer to the root node of the created hash table.
+ */
+HashNode* create_integer_hash(int64_t *integers, Payload *payloads, size_t num_integers) {
+    BuildContext ctx = {0, 0};
+    return build_integer_node(integers, payloads, num_integers, &ctx);
+}
+
+/**
+ * @brief Creates a set (no payloads) for a set of integers.
+ *
+ * @param integers Pointer to the array of integers.
+ * @param num_integers Number of integers.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_integer_set(int64_t *integers, size_t num_integers) {
+    BuildContext ctx = {HASHNODE_SET, 0};
+    return build_integer_node(integers, NULL, num_integers, &ctx);
+}
+
+/**
+ * @brief Creates an approximate membership filter for a set of integers.
+ *
+ * @param integers Pointer to the array of integers.
+ * @param num_integers Number of integers.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_integer_filter(int64_t *integers, size_t num_integers, int fingerprint_bits) {
+    BuildContext ctx = {HASHNODE_SET | HASHNODE_FILTER, 0};
+    if (fingerprint_bits != 8 && fingerprint_bits != 16 && fingerprint_bits != 32) {
+        return NULL;
+    }
+    ctx.fingerprint_bits = (uint8_t)fingerprint_bits;
+    return build_integer_node(integers, NULL, num_integers, &ctx);
+}
+
+/**
+ * @brief Creates a retrieval only tree for a set of integers - see create_binary_retrieval().
+ *
+ * @param integers Pointer to the array of integers.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_integers Number of integers.
+ * @return Pointer to the root node of the created tree.
+ */
+HashNode* create_integer_retrieval(int64_t *integers, Payload *payloads, size_t num_integers) {
+    BuildContext ctx = {HASHNODE_RETRIEVAL, 0};
+    return build_integer_node(integers, payloads, num_integers, &ctx);
+}
+
 /**
  * @brief Looks up an integer in the hash node.
  *
@@ -737,14 +3993,15 @@ int lookup_integer(int64_t integer, const HashNode *node, Payload *payload_out)
 }
 
 /**
- * @brief Creates a hash table for a set of doubles.
+ * @brief Builds a tree for a set of doubles.
  *
  * @param doubles Pointer to the array of doubles.
- * @param payloads Pointer to the array of payloads.
+ * @param payloads Pointer to the array of payloads (ignored for sets).
  * @param num_doubles Number of doubles.
+ * @param ctx Build settings.
  * @return Pointer to the root node of the created hash table.
  */
-HashNode* create_double_hash(double *doubles, Payload *payloads, size_t num_doubles) {
+static HashNode* build_double_node(double *doubles, Payload *payloads, size_t num_doubles, const BuildContext *ctx) {
     // Convert the doubles to binary values
     BinaryValue *values = malloc(num_doubles * sizeof(BinaryValue));
     if (values == NULL) {
@@ -757,11 +4014,66 @@ HashNode* create_double_hash(double *doubles, Payload *payloads, size_t num_doub
         values[i].binary = (uint8_t*)&doubles[i];
         values[i].length = sizeof(doubles[i]);
     }
-    HashNode *hash = create_binary_hash(values, payloads, num_doubles);
+    HashNode *hash = build_root_node(values, payloads, num_doubles, ctx);
     free(values);
     return hash;
 }
 
+/**
+ * @brief Creates a hash table for a set of doubles.
+ *
+ * @param doubles Pointer to the array of doubles.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_doubles Number of doubles.
+ * @return Pointer to the root node of the created hash table.
+ */
+HashNode* create_double_hash(double *doubles, Payload *payloads, size_t num_doubles) {
+    BuildContext ctx = {0, 0};
+    return build_double_node(doubles, payloads, num_doubles, &ctx);
+}
+
+/**
+ * @brief Creates a set (no payloads) for a set of doubles.
+ *
+ * @param doubles Pointer to the array of doubles.
+ * @param num_doubles Number of doubles.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_double_set(double *doubles, size_t num_doubles) {
+    BuildContext ctx = {HASHNODE_SET, 0};
+    return build_double_node(doubles, NULL, num_doubles, &ctx);
+}
+
+/**
+ * @brief Creates an approximate membership filter for a set of doubles.
+ *
+ * @param doubles Pointer to the array of doubles.
+ * @param num_doubles Number of doubles.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_double_filter(double *doubles, size_t num_doubles, int fingerprint_bits) {
+    BuildContext ctx = {HASHNODE_SET | HASHNODE_FILTER, 0};
+    if (fingerprint_bits != 8 && fingerprint_bits != 16 && fingerprint_bits != 32) {
+        return NULL;
+    }
+    ctx.fingerprint_bits = (uint8_t)fingerprint_bits;
+    return build_double_node(doubles, NULL, num_doubles, &ctx);
+}
+
+/**
+ * @brief Creates a retrieval only tree for a set of doubles - see create_binary_retrieval().
+ *
+ * @param doubles Pointer to the array of doubles.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_doubles Number of doubles.
+ * @return Pointer to the root node of the created tree.
+ */
+HashNode* create_double_retrieval(double *doubles, Payload *payloads, size_t num_doubles) {
+    BuildContext ctx = {HASHNODE_RETRIEVAL, 0};
+    return build_double_node(doubles, payloads, num_doubles, &ctx);
+}
+
 /**
  * @brief Looks up a double in the hash node.
  *
@@ -793,15 +4105,16 @@ static void hash_efficiency(const HashNode *node, size_t *slots_used, size_t *em
     size_t max_comparisons_needed = 0;
     size_t total_slots = 0;
     size_t total_empty_slots = 0;
-    for (i = 0; i <= node->num_slots; i++) {
+    for (i = 0; i < HASHNODE_SLOT_COUNT(node); i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
         total_slots++;
-        if (node->slot[i].count == 0) {
+        if (slot->count == 0) {
             total_empty_slots++;
-        } else if (node->slot[i].count == 1) {
+        } else if (slot->count == 1) {
             total_comparisons++;
         } else {
             size_t child_slots_used, child_empty_slots, child_max_comparisons;
-            hash_efficiency(node->slot[i].next_node.child, &child_slots_used, &child_empty_slots, &child_max_comparisons);
+            hash_efficiency(slot->next_node.child, &child_slots_used, &child_empty_slots, &child_max_comparisons);
             total_slots += child_slots_used;
             total_empty_slots += child_empty_slots;
             total_comparisons += child_max_comparisons;
@@ -826,5 +4139,80 @@ void hash_table_efficiency(const HashNode *node, int *slot_efficiency, size_t *m
     size_t slots_used, empty_slots;
     hash_efficiency(node, &slots_used, &empty_slots, max_comparisons);
     *slot_efficiency = (int)(slots_used * 100 / (slots_used + empty_slots));
-    printf("Slots used: %d, Slot efficiency: %d%%, Max comparisons: %d\n", (int)slots_used, *slot_efficiency, (int)*max_comparisons);
+    printf("Slots used: %d, Slot efficiency: %d%%, Max comparisons: %d, Bytes: %d\n", (int)slots_used, *slot_efficiency,
+           (int)*max_comparisons, (int)hash_table_bytes(node));
+}
+
+/**
+ * @brief Returns the bytes allocated for the hash table.
+ *
+ * The nodes and the leaves are counted, but not the keys the leaves point to (the caller's) - except for a packed
+ * tree (relayout_tree()), where the keys are in its buffer.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @return The bytes of the hash table.
+ */
+size_t hash_table_bytes(const HashNode *node) { // NOLINT
+    size_t i, bytes = node_alloc_bytes(node);
+    for (i = 0; i < HASHNODE_SLOT_COUNT(node); i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
+        if (slot->count > 1) {
+            bytes += hash_table_bytes(slot->next_node.child);
+        }
+        else if (slot->count == 1 && !(node->flags & HASHNODE_KEYLESS) && slot->next_node.leaf != NULL) {
+            bytes += sizeof(LeafValue);
+            if (node->flags & HASHNODE_PACKED) {
+                bytes += PACK_ALIGN(slot->next_node.leaf->value.length);
+            }
+        }
+    }
+    return bytes;
+}
+
+/**
+ * @brief Prints and returns how much of a space budget the hash table uses.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @param max_bytes The space budget in bytes (e.g. HashBuildOptions max_bytes).
+ * @param budget_used Pointer to the variable to store the percentage of the budget used.
+ */
+void hash_table_budget(const HashNode *node, size_t max_bytes, int *budget_used) {
+    size_t bytes = hash_table_bytes(node);
+    *budget_used = max_bytes ? (int)((double)bytes * 100 / (double)max_bytes) : 0;
+    printf("Bytes: %lu of a budget of %lu (%d%%)\n", (unsigned long)bytes, (unsigned long)max_bytes, *budget_used);
+}
+
+/**
+ * @brief Sums the depths of the keys in a subtree.
+ *
+ * @param node Pointer to the root node of the subtree.
+ * @param depth Depth of the node (1 for the root).
+ * @param num_keys Pointer to the variable to add the number of keys to.
+ * @return The sum of the depths of the keys.
+ */
+static size_t sum_key_depths(const HashNode *node, size_t depth, size_t *num_keys) { // NOLINT
+    size_t i, total = 0;
+    for (i = 0; i < HASHNODE_SLOT_COUNT(node); i++) {
+        const HashSlot *slot = HASHNODE_SLOT(node, i);
+        if (slot->count == 1) {
+            (*num_keys)++;
+            total += depth;
+        }
+        else if (slot->count > 1) {
+            total += sum_key_depths(slot->next_node.child, depth + 1, num_keys);
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief Returns the average depth of the keys in the hash table.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @return The average number of nodes visited to find a key.
+ */
+double hash_table_average_depth(const HashNode *node) {
+    size_t num_keys = 0;
+    size_t total = sum_key_depths(node, 1, &num_keys);
+    return num_keys ? (double)total / (double)num_keys : 0;
 }
\ No newline at end of file
@@ -45,6 +45,77 @@ typedef union {
 
 typedef struct HashNode HashNode;
 
+// Table modes for HashBuildOptions
+#define ACPH_MODE_HASH 0      // Keys and payloads (as create_*_hash)
+#define ACPH_MODE_SET 1       // Keys only (as create_*_set)
+#define ACPH_MODE_FILTER 2    // Key fingerprints only (as create_*_filter)
+#define ACPH_MODE_RETRIEVAL 3 // Payloads only (as create_*_retrieval)
+
+// Largest bucket_size for HashBuildOptions
+#define ACPH_MAX_BUCKET_SIZE 4
+
+// Column scoring policies for HashBuildOptions - how the builder picks the column of each node
+#define ACPH_SCORE_MAX_OCCURRENCE 0 // Smallest largest group
+#define ACPH_SCORE_ENTROPY 1        // Most information (Shannon entropy of the characters)
+#define ACPH_SCORE_SUM_OF_SQUARES 2 // Smallest sum of the squared group sizes (expected group size of a key)
+
+// Largest beam_width for HashBuildOptions
+#define ACPH_MAX_BEAM_WIDTH 16
+
+// Largest number of threads for HashBuildOptions
+#define ACPH_MAX_THREADS 64
+
+// Default parallel_threshold for HashBuildOptions - the number of keys from which a node is built on threads
+#define ACPH_PARALLEL_THRESHOLD 65536
+
+// Instruction set levels of the build kernels - see force_simd_level()
+#define ACPH_SIMD_AUTO -1    // The best level of the CPU (picked at startup)
+#define ACPH_SIMD_SCALAR 0   // Portable C
+#define ACPH_SIMD_SSE42 1    // SSE4.2 and POPCNT
+#define ACPH_SIMD_AVX2 2     // AVX2
+#define ACPH_SIMD_AVX512 3   // AVX-512 (F and BW)
+
+// Build effort levels for HashBuildOptions - how hard the builder searches
+#define ACPH_EFFORT_BALANCED 0 // Searches where it can pay off
+#define ACPH_EFFORT_FAST 1     // Scores columns on a sample of large groups (for large or frequent builds)
+#define ACPH_EFFORT_THOROUGH 2 // Also a beam search (if beam_width is not set)
+
+// Progress callback for HashBuildOptions - the keys placed in leaves and the nodes created so far
+typedef void (*build_progress_func)(size_t keys_placed, size_t nodes_created, void *progress_data);
+
+// Build options for the create_*_ex functions - initialise with init_build_options() then set the fields needed
+typedef struct HashBuildOptions {
+    int mode;             // Table mode (ACPH_MODE_HASH, ACPH_MODE_SET, ACPH_MODE_FILTER or ACPH_MODE_RETRIEVAL)
+    int fingerprint_bits; // Fingerprint bits for ACPH_MODE_FILTER (8, 16 or 32)
+    int length_dispatch;  // Non-zero to dispatch on the key length before the column tree (variable length keys)
+    int bucket_size;      // 0 for none, or up to this many (2 to ACPH_MAX_BUCKET_SIZE) colliding keys share a bucket
+    int wide_columns;     // Non-zero to allow nodes on two adjacent columns (16 bit keys) where they pay off
+    int column_scoring;   // Column scoring policy (ACPH_SCORE_MAX_OCCURRENCE, ACPH_SCORE_ENTROPY, ACPH_SCORE_SUM_OF_SQUARES)
+    int beam_width;       // 0 for a greedy build, or the number (up to ACPH_MAX_BEAM_WIDTH) of columns tried per node
+    const double *weights; // Access weight of each key, e.g. its count in a trace (NULL for equal weights)
+    int max_depth;        // 0 for no bound, or the most nodes a lookup may visit (the build fails if it can not be met,
+                          // see create_binary_hash_ex() for the build cost)
+    size_t max_bytes;     // 0 for no budget, or the most bytes the tree may take - see hash_table_bytes() (the build
+                          // fails if it can not be met)
+    int effort;           // Build effort (ACPH_EFFORT_BALANCED, ACPH_EFFORT_FAST or ACPH_EFFORT_THOROUGH)
+    double time_budget;   // 0 for none, or the seconds after which the builder stops searching and finishes the tree
+    build_progress_func progress; // NULL for none, or called as the build goes on
+    void *progress_data;  // Passed to progress
+    volatile int *cancel; // NULL for none, or a flag that cancels the build once set non-zero (e.g. by another thread)
+    int threads;          // 0 or 1 for a single threaded build, or the threads large nodes are built on
+    size_t parallel_threshold; // Nodes of at least this many keys are built on the threads
+} HashBuildOptions;
+
+/**
+ * @brief Initialises build options to the defaults (ACPH_MODE_HASH, 16 bit fingerprints, no length dispatch, no
+ * buckets, no wide columns, ACPH_SCORE_MAX_OCCURRENCE, a greedy build, equal weights, no depth bound, no space budget,
+ * ACPH_EFFORT_BALANCED, no time budget, no progress callback or cancel flag, single threaded with a
+ * parallel_threshold of ACPH_PARALLEL_THRESHOLD).
+ *
+ * @param options Pointer to the build options.
+ */
+void init_build_options(HashBuildOptions *options);
+
 /**
  * @brief Frees the tree structure.
  *
@@ -109,6 +180,22 @@ void print_char_leaf(const HashNode *node, int slot);
  */
 void print_binary_leaf(const HashNode *node, int slot);
 
+/**
+ * @brief Helper function to print a filter leaf node (filters only keep a fingerprint of the key).
+ *
+ * @param node Pointer to the hash node.
+ * @param slot Slot index in the hash table.
+ */
+void print_fingerprint_leaf(const HashNode *node, int slot);
+
+/**
+ * @brief Helper function to print a retrieval leaf node (retrieval trees only keep the payload).
+ *
+ * @param node Pointer to the hash node.
+ * @param slot Slot index in the hash table.
+ */
+void print_payload_leaf(const HashNode *node, int slot);
+
 /**
  * @brief Creates a hash table for characters/bytes provided as a byte buffer & length.
  *
@@ -129,6 +216,17 @@ HashNode* create_character_hash(uint8_t *characters, Payload *payloads, size_t n
  */
 int lookup_character(uint8_t character, const HashNode *node, Payload *payload_out);
 
+/**
+ * @brief Creates a set (membership only, no payload storage) for characters/bytes.
+ *
+ * Look up members with lookup_character(); payload_out may be NULL and is set to a zero payload.
+ *
+ * @param characters Pointer to the array of characters.
+ * @param num_chars Number of characters.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_character_set(uint8_t *characters, size_t num_chars);
+
 /**
  * @brief Creates the tree structure from a set of binary buffers.
  *
@@ -139,6 +237,73 @@ int lookup_character(uint8_t character, const HashNode *node, Payload *payload_o
  */
 HashNode* create_binary_hash(BinaryValue *values, Payload *payloads, size_t num_values);
 
+/**
+ * @brief Creates the tree structure from a set of binary buffers with build options.
+ *
+ * With length_dispatch set the tree starts with a node that hashes the key length (lengths of 255 and more share
+ * one bucket). Keys with a length not in the set are rejected there, and each length gets its own smaller column
+ * tree without zero padding.
+ *
+ * With bucket_size set a group of up to bucket_size keys that collide in a slot is kept in a bucket rather than a
+ * child node with its own column - the bucket's keys are found from their leaf fingerprints, compared all at once.
+ * This saves a level and the memory of a hash table for small groups. Buckets are not used for filters and
+ * retrieval trees (they keep no keys to tell the bucket's keys apart).
+ *
+ * With wide_columns set a node can read two adjacent columns as a 16 bit key, with up to 65536 slots, so large
+ * key sets (e.g. integers or UUIDs) need a level less. The builder only uses one for a large group of keys when
+ * it splits them better than one column, and the memory of its 10K bitmap is paid for by the level it saves.
+ *
+ * column_scoring picks the column of each node. ACPH_SCORE_MAX_OCCURRENCE takes the column with the smallest
+ * largest group. ACPH_SCORE_ENTROPY and ACPH_SCORE_SUM_OF_SQUARES look at all the groups, so they estimate the
+ * depth of the subtrees below better, e.g. a column with one large group and many single keys is preferred to
+ * a column with a few groups of the same size.
+ *
+ * With beam_width set the builder is no longer greedy: at each node the beam_width best scoring columns are
+ * compared by building the subtree below each of them, and the column with the fewest node visits is used.
+ * This is for tables that are built rarely and queried often - the build takes several times longer.
+ *
+ * With weights set (one per key, in the order of the keys) the builder minimises the expected lookup cost rather
+ * than treating all keys the same: columns are scored by the weight of the keys in each group, so the heaviest
+ * keys end up alone in their slots - as leaves - as near the root as possible. The beam search also weighs each
+ * key's depth.
+ *
+ * With max_depth set no lookup visits more than max_depth nodes (see lookup_binary_depth()), bounding the worst
+ * case lookup time. Where the usual node would give a subtree that is too deep the builder switches to a wide
+ * node, other columns and, at the last level, a bucket (even if bucket_size is not set) or a node with no
+ * collisions. The build fails (returns NULL) if none of these meet the bound. A group with more keys than its
+ * levels can tell apart (from the characters its columns take) fails at once, and a node that would keep a group
+ * that already failed together is not tried, so a bound the keys can not meet fails about as fast as a build
+ * without one. A bound that is only just met may still cost up to DEPTH_CANDIDATES (4) columns plus a wide and a
+ * pair node tried per node on each level, rebuilding the subtrees below them.
+ *
+ * effort trades build time for the tree. ACPH_EFFORT_BALANCED only searches for a hashed table where one could
+ * beat the compact layouts. ACPH_EFFORT_FAST never does (using the natural 256 slot table) and scores the columns
+ * of large groups on a sample of their keys. ACPH_EFFORT_THOROUGH adds a beam search of 4 columns if beam_width
+ * is not set.
+ *
+ * With time_budget set, once that many seconds have passed the builder stops searching - it takes the best hash
+ * table found so far, drops any beam search and builds the rest of the tree as a fast build would. This keeps
+ * build times predictable. A depth bound or space budget is still met.
+ *
+ * progress is called with the number of keys placed in leaves and of nodes created, about every 16K keys and
+ * once with the totals when the build is done. The counts go back down when the builder throws a subtree away
+ * (beam searches, max_depth and max_bytes rebuild parts of the tree). Once *cancel is set non-zero the build
+ * stops at the next node, frees everything it has built and returns NULL.
+ *
+ * With threads set (up to ACPH_MAX_THREADS), nodes of at least parallel_threshold keys score their candidate
+ * columns, and try each hash table, split over that many threads. Smaller nodes are built on the calling thread.
+ * The tree is the same as a single threaded build. Without ACPH_THREADS (set by the CMake build when pthreads are
+ * available) the build is always single threaded.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param payloads Pointer to the array of payloads (ignored for sets and filters, may be NULL).
+ * @param num_values Number of binary values.
+ * @param options Pointer to the build options (NULL for the defaults).
+ * @return Pointer to the root node of the created tree, NULL for duplicates, invalid options or a depth bound that
+ * can not be met.
+ */
+HashNode* create_binary_hash_ex(BinaryValue *values, Payload *payloads, size_t num_values, const HashBuildOptions *options);
+
 /**
  * @brief Compares a binary against the tree structure.
  *
@@ -149,6 +314,45 @@ HashNode* create_binary_hash(BinaryValue *values, Payload *payloads, size_t num_
  */
 int lookup_binary(const BinaryValue *str, const HashNode *node, Payload *payload_out);
 
+/**
+ * @brief Creates a set (membership only, no payload storage) from a set of binary buffers.
+ *
+ * Look up members with lookup_binary(); payload_out may be NULL and is set to a zero payload.
+ *
+ * @param values Pointer to the array of binary values.
+ * @param num_values Number of binary values.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_binary_set(BinaryValue *values, size_t num_values);
+
+/**
+ * @brief Creates an approximate membership filter for a set of binary buffers.
+ *
+ * The leaves keep only a fingerprint of each key and no key bytes, so lookup_binary() can return a false positive
+ * for a non-member with a probability of about 2^-fingerprint_bits. Members are always found. Note that
+ * payload_out may be NULL and is set to a zero payload.
+ *
+ * @param values Pointer to the array of values.
+ * @param num_values Number of values.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_binary_filter(BinaryValue *values, size_t num_values, int fingerprint_bits);
+
+/**
+ * @brief Creates a retrieval only tree for a set of binary buffers.
+ *
+ * Only the tree and the payloads are stored - no keys are kept and lookup_binary() does not verify the leaf.
+ * Every member returns its payload, but a non-member can return 1 with an arbitrary payload. Use this only
+ * when every queried key is known to be a member.
+ *
+ * @param values Pointer to the array of values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_values Number of values.
+ * @return Pointer to the root node of the created tree, NULL for duplicates.
+ */
+HashNode* create_binary_retrieval(BinaryValue *values, Payload *payloads, size_t num_values);
+
 /**
  * @brief Creates a hash table for a set of null-terminated strings.
  *
@@ -159,6 +363,17 @@ int lookup_binary(const BinaryValue *str, const HashNode *node, Payload *payload
  */
 HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_strings);
 
+/**
+ * @brief Creates a tree for a set of null-terminated strings with build options - see create_binary_hash_ex().
+ *
+ * @param strings Pointer to the array of strings.
+ * @param payloads Pointer to the array of payloads (ignored for sets and filters, may be NULL).
+ * @param num_strings Number of strings.
+ * @param options Pointer to the build options (NULL for the defaults).
+ * @return Pointer to the root node of the created tree, NULL for duplicates or invalid options.
+ */
+HashNode* create_string_hash_ex(uint8_t **strings, Payload *payloads, size_t num_strings, const HashBuildOptions *options);
+
 /**
  * @brief Looks up a string in the hash node.
  *
@@ -169,6 +384,45 @@ HashNode* create_string_hash(uint8_t **strings, Payload *payloads, size_t num_st
  */
 int lookup_string(const uint8_t *str, const HashNode *node, Payload *payload_out);
 
+/**
+ * @brief Creates a set (membership only, no payload storage) for null-terminated strings.
+ *
+ * Look up members with lookup_string(); payload_out may be NULL and is set to a zero payload.
+ *
+ * @param strings Pointer to the array of strings.
+ * @param num_strings Number of strings.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_string_set(uint8_t **strings, size_t num_strings);
+
+/**
+ * @brief Creates an approximate membership filter for a set of null-terminated strings.
+ *
+ * The leaves keep only a fingerprint of each key and no key bytes, so lookup_string() can return a false positive
+ * for a non-member with a probability of about 2^-fingerprint_bits. Members are always found. Note that
+ * payload_out may be NULL and is set to a zero payload.
+ *
+ * @param strings Pointer to the array of values.
+ * @param num_strings Number of values.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_string_filter(uint8_t **strings, size_t num_strings, int fingerprint_bits);
+
+/**
+ * @brief Creates a retrieval only tree for a set of null-terminated strings.
+ *
+ * Only the tree and the payloads are stored - no keys are kept and lookup_string() does not verify the leaf.
+ * Every member returns its payload, but a non-member can return 1 with an arbitrary payload. Use this only
+ * when every queried key is known to be a member.
+ *
+ * @param strings Pointer to the array of values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_strings Number of values.
+ * @return Pointer to the root node of the created tree, NULL for duplicates.
+ */
+HashNode* create_string_retrieval(uint8_t **strings, Payload *payloads, size_t num_strings);
+
 /**
  * @brief Creates a hash table for a set of integers.
  *
@@ -189,6 +443,45 @@ HashNode* create_integer_hash(int64_t *integers, Payload *payloads, size_t num_i
  */
 int lookup_integer(int64_t integer, const HashNode *node, Payload *payload_out);
 
+/**
+ * @brief Creates a set (membership only, no payload storage) for integers.
+ *
+ * Look up members with lookup_integer(); payload_out may be NULL and is set to a zero payload.
+ *
+ * @param integers Pointer to the array of integers.
+ * @param num_integers Number of integers.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_integer_set(int64_t *integers, size_t num_integers);
+
+/**
+ * @brief Creates an approximate membership filter for a set of integers.
+ *
+ * The leaves keep only a fingerprint of each key and no key bytes, so lookup_integer() can return a false positive
+ * for a non-member with a probability of about 2^-fingerprint_bits. Members are always found. Note that
+ * payload_out may be NULL and is set to a zero payload.
+ *
+ * @param integers Pointer to the array of values.
+ * @param num_integers Number of values.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_integer_filter(int64_t *integers, size_t num_integers, int fingerprint_bits);
+
+/**
+ * @brief Creates a retrieval only tree for a set of integers.
+ *
+ * Only the tree and the payloads are stored - no keys are kept and lookup_integer() does not verify the leaf.
+ * Every member returns its payload, but a non-member can return 1 with an arbitrary payload. Use this only
+ * when every queried key is known to be a member.
+ *
+ * @param integers Pointer to the array of values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_integers Number of values.
+ * @return Pointer to the root node of the created tree, NULL for duplicates.
+ */
+HashNode* create_integer_retrieval(int64_t *integers, Payload *payloads, size_t num_integers);
+
 /**
  * @brief Creates a hash table for a set of real numbers (doubles).
  *
@@ -209,6 +502,45 @@ HashNode* create_double_hash(double *reals, Payload *payloads, size_t num_double
  */
 int lookup_double(double real, const HashNode *node, Payload *payload_out);
 
+/**
+ * @brief Creates a set (membership only, no payload storage) for real numbers (doubles).
+ *
+ * Look up members with lookup_double(); payload_out may be NULL and is set to a zero payload.
+ *
+ * @param reals Pointer to the array of real numbers.
+ * @param num_doubles Number of real numbers.
+ * @return Pointer to the root node of the created set.
+ */
+HashNode* create_double_set(double *reals, size_t num_doubles);
+
+/**
+ * @brief Creates an approximate membership filter for a set of real numbers (doubles).
+ *
+ * The leaves keep only a fingerprint of each key and no key bytes, so lookup_double() can return a false positive
+ * for a non-member with a probability of about 2^-fingerprint_bits. Members are always found. Note that
+ * payload_out may be NULL and is set to a zero payload.
+ *
+ * @param reals Pointer to the array of values.
+ * @param num_doubles Number of values.
+ * @param fingerprint_bits Number of fingerprint bits (8, 16 or 32).
+ * @return Pointer to the root node of the created filter, NULL for duplicates or an invalid fingerprint_bits.
+ */
+HashNode* create_double_filter(double *reals, size_t num_doubles, int fingerprint_bits);
+
+/**
+ * @brief Creates a retrieval only tree for a set of real numbers (doubles).
+ *
+ * Only the tree and the payloads are stored - no keys are kept and lookup_double() does not verify the leaf.
+ * Every member returns its payload, but a non-member can return 1 with an arbitrary payload. Use this only
+ * when every queried key is known to be a member.
+ *
+ * @param reals Pointer to the array of values.
+ * @param payloads Pointer to the array of payloads.
+ * @param num_doubles Number of values.
+ * @return Pointer to the root node of the created tree, NULL for duplicates.
+ */
+HashNode* create_double_retrieval(double *reals, Payload *payloads, size_t num_doubles);
+
 /**
  * @brief Prints and returns the efficiency of the hash table.
  *
@@ -218,4 +550,74 @@ int lookup_double(double real, const HashNode *node, Payload *payload_out);
  */
 void hash_table_efficiency(const HashNode *node, int *slot_efficiency, size_t *max_comparisons);
 
+/**
+ * @brief Returns the bytes allocated for the hash table - its nodes and leaves, not the keys the leaves point to.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @return The bytes of the hash table.
+ */
+size_t hash_table_bytes(const HashNode *node);
+
+/**
+ * @brief Prints and returns how much of a space budget the hash table uses.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @param max_bytes The space budget in bytes (e.g. HashBuildOptions max_bytes).
+ * @param budget_used Pointer to the variable to store the percentage of the budget used.
+ */
+void hash_table_budget(const HashNode *node, size_t max_bytes, int *budget_used);
+
+/**
+ * @brief Returns the average depth of the keys in the hash table.
+ *
+ * @param node Pointer to the root node of the hash table.
+ * @return The average number of nodes visited to find a key.
+ */
+double hash_table_average_depth(const HashNode *node);
+
+/**
+ * @brief Returns the number of nodes visited to look up a binary.
+ *
+ * @param str Pointer to the binary value.
+ * @param node Pointer to the root node of the tree.
+ * @return The number of nodes visited - to the binary's leaf, or to the node that rejects it.
+ */
+size_t lookup_binary_depth(const BinaryValue *str, const HashNode *node);
+
+/**
+ * @brief Copies a tree into one packed buffer laid out for a lookup trace.
+ *
+ * The nodes and leaves (with copies of their keys) are ordered by the number of lookups in the trace that reach
+ * them, hottest first, so hot lookups touch fewer cache lines and pages. The tree is only read, so this can run
+ * in the background while the tree serves lookups - the copy is then swapped in and the original freed once no
+ * lookups are using it.
+ *
+ * @param node Pointer to the root node of the tree.
+ * @param trace Pointer to the array of looked up binaries (NULL for none).
+ * @param trace_length Number of binaries in the trace.
+ * @return Pointer to the root node of the packed copy (free it with free_tree()), NULL for an empty tree.
+ */
+HashNode *relayout_tree(const HashNode *node, const BinaryValue *trace, size_t trace_length);
+
+/**
+ * @brief Returns the instruction set level of the build kernels in use.
+ *
+ * The build kernels (the byte counts of the column scans) are compiled for each level and the best level of the
+ * CPU is picked when the library is loaded, so one binary runs on any x86 host. Other compilers and CPUs only have
+ * ACPH_SIMD_SCALAR. Lookups do not depend on the level.
+ *
+ * @return The level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512).
+ */
+int simd_level(void);
+
+/**
+ * @brief Forces the build kernels to an instruction set level, e.g. to benchmark the levels against each other.
+ *
+ * Not thread safe - call it while no trees are being built.
+ *
+ * @param level The level (ACPH_SIMD_SCALAR to ACPH_SIMD_AVX512), or ACPH_SIMD_AUTO for the best level of the CPU.
+ * @return 1 if the level is used, 0 if the CPU (or the compiler) does not support it.
+ */
+int force_simd_level(int level);
+
 #endif // ACPH_H
\ No newline at end of file
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "acph.h"
 
@@ -43,7 +44,7 @@ char* print_char(uint8_t c) {
     return buffer;
 }
 
-int a_binary_test(BinaryValue *values, size_t num_values) {
+int a_binary_test_ex(BinaryValue *values, size_t num_values, const HashBuildOptions *options) {
     int i;
     int errors = 0;
     Payload payload;
@@ -65,7 +66,7 @@ int a_binary_test(BinaryValue *values, size_t num_values) {
         }
     }
 
-    HashNode* root = create_binary_hash(values, payloads, num_values);
+    HashNode* root = options ? create_binary_hash_ex(values, payloads, num_values, options) : create_binary_hash(values, payloads, num_values);
     if (root == NULL) {
         if (has_duplicates) {
             return 0;
@@ -129,10 +130,33 @@ int a_binary_test(BinaryValue *values, size_t num_values) {
         }
     }
 
+    // Search for all the values with one byte changed - leaves only compare the bytes not matched on the path
+    // so this checks every byte is matched somewhere. The test values are 7 bit so setting the top bit never
+    // gives another test value.
+    for (i = 0; i < num_values; i++) {
+        size_t k;
+        BinaryValue near_miss;
+        near_miss.length = values[i].length;
+        near_miss.binary = (uint8_t *)malloc(values[i].length + 1);
+        for (k = 0; k < values[i].length; k++) {
+            memcpy(near_miss.binary, values[i].binary, values[i].length);
+            near_miss.binary[k] ^= 0x80;
+            if (lookup_binary(&near_miss, root, &payload)) {
+                printf("Error '%.*s' with byte %d changed found!\n", (int)values[i].length, values[i].binary, (int)k);
+                errors++;
+            }
+        }
+        free(near_miss.binary);
+    }
+
     free_tree(root);
     return errors;
 }
 
+int a_binary_test(BinaryValue *values, size_t num_values) {
+    return a_binary_test_ex(values, num_values, NULL);
+}
+
 // Helper function to convert an array of strings to an array of BinaryValue
 BinaryValue *strings_to_binary(char **strings, size_t num_strings) {
     int i;
@@ -170,20 +194,19 @@ int test_binaries() {
     return errors;
 }
 
-/* Full test of binary values */
-int full_test_binary() {
+/* Full test of binary values - built with the given build options (NULL for create_binary_hash) */
+int full_test_binary_ex(const HashBuildOptions *options) {
     int errors = 0;
     BinaryValue *strings_with_length;
     size_t num_strings;
 
-    printf("Testing BinaryValue Hashing - Edge Cases\n");
     // Edge Cases
     // Test with a single character
     {
         char *test[] = {"A"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with a single string
@@ -191,7 +214,7 @@ int full_test_binary() {
         char *test[] = {"AB"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with no strings
@@ -199,7 +222,7 @@ int full_test_binary() {
         char *test[] = {""};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with 2 identical strings
@@ -207,7 +230,7 @@ int full_test_binary() {
         char *test[] = {"AB", "AB"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with a few strings with two being identical
@@ -215,7 +238,7 @@ int full_test_binary() {
         char *test[] = {"AB", "ABC", "AB", "ABCD", "ABCDE"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with a few different length  strings
@@ -223,7 +246,7 @@ int full_test_binary() {
         char *test[] = {"AB", "ABC", "ABCD", "ABCDE", "ABCDEF"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
     // Test with a lot of values - 1000 strings - but with common prefixes
@@ -243,7 +266,7 @@ int full_test_binary() {
         }
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         // Free the strings
         for (i = 0; i < 1000; i++) {
             free(test[i]);
@@ -277,7 +300,7 @@ int full_test_binary() {
         }
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         // Free the strings
         for (i = 0; i < 1000; i++) {
             free(test[i]);
@@ -290,13 +313,20 @@ int full_test_binary() {
         char *test[] = {"Mr Smith", "Mr Jones", "", "Ms James", "Mrs Peabody", "Mr Smile"};
         num_strings = sizeof(test) / sizeof(test[0]);
         strings_with_length = strings_to_binary(test, num_strings);
-        errors += a_binary_test(strings_with_length, num_strings);
+        errors += a_binary_test_ex(strings_with_length, num_strings, options);
         free(strings_with_length);
     }
 
     return errors;
 }
 
+/* Full test of binary values */
+int full_test_binary() {
+    printf("Testing BinaryValue Hashing - Edge Cases\n");
+    return full_test_binary_ex(NULL);
+}
+
+
 int a_character_test(uint8_t * characters, size_t num_chars) {
     int errors = 0;
     uint8_t c;
@@ -506,6 +536,30 @@ int a_string_test(char **strings, size_t num_strings) {
             printf("String: %s found but expected payload %d but got %d\n", strings[i], (int)payloads[i].integer, (int)payload.integer);
         }
     }
+
+    // Test exact size copies of the strings (so memory checkers catch any read past the terminator), and the
+    // strings extended by a byte which must not be found. The test strings are 7 bit so 0x80 is never in them.
+    for (i = 0; i < num_strings; i++) {
+        size_t length = strlen(strings[i]);
+        char *copy = (char *)malloc(length + 2);
+        if (copy == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        memcpy(copy, strings[i], length + 1);
+        if (!lookup_string((uint8_t*)copy, hash_table, &payload) || payloads[i].integer != payload.integer) {
+            passed = 0;
+            printf("String: %s copy not found (Error)\n", strings[i]);
+        }
+        copy[length] = (char)0x80;
+        copy[length + 1] = 0;
+        if (lookup_string((uint8_t*)copy, hash_table, &payload)) {
+            passed = 0;
+            printf("String: %s extended by a byte found (Error)\n", strings[i]);
+        }
+        free(copy);
+    }
     if (!passed) {
         printf("There were errors\n");
         errors++;
@@ -891,7 +945,1581 @@ int full_test_doubles() {
     return errors;
 }
 
+// Test a set (no payloads) of null terminated strings
+int a_string_set_test(char **strings, size_t num_strings) {
+    int errors = 0;
+    HashNode *set;
+    int i;
+    Payload payload;
+
+    set = create_string_set((uint8_t**)strings, num_strings);
+    if (set == NULL) {
+        printf("Error creating string set\n");
+        return 1;
+    }
+
+    {
+        int slot_efficiency;
+        size_t max_comparisons;
+        hash_table_efficiency(set, &slot_efficiency, &max_comparisons);
+    }
+
+    // Test with a not found string
+    {
+        char *never_find = "NeverAValidValueInTheseTests";
+        if (lookup_string((uint8_t*)never_find, set, NULL)) {
+            printf("Error '%s' found in set!\n", never_find);
+            errors++;
+        }
+    }
+
+    // Test the strings with the set - the payload should always be zero
+    for (i = 0; i < num_strings; i++) {
+        payload.integer = -1;
+        if (!lookup_string((uint8_t*)strings[i], set, NULL)) {
+            printf("String: %s not found in set (Error)\n", strings[i]);
+            errors++;
+        }
+        else if (!lookup_string((uint8_t*)strings[i], set, &payload) || payload.integer != 0) {
+            printf("String: %s found in set but the payload is not zero (Error)\n", strings[i]);
+            errors++;
+        }
+    }
+
+    free_tree(set);
+
+    return errors;
+}
+
+// Test sets
+int test_sets() {
+    char *test1[] = {
+            "Mr Smith", "Mr Jones", "Ms Leonard", "Ms James", "Mrs Peabody", "Mr Smile"
+    };
+    int errors = 0;
+
+    printf("Testing Set Hashing\n");
+
+    errors += a_string_set_test(test1, sizeof(test1) / sizeof(test1[0]));
+
+    // Character set
+    {
+        char *characters = "AXY178bxyTQFpq";
+        HashNode *set = create_character_set((uint8_t*)characters, strlen(characters));
+        int i;
+        for (i = 0; i < 256; i++) {
+            int expected = (i != 0 && strchr(characters, i) != NULL);
+            if (lookup_character(i, set, NULL) != expected) {
+                printf("Character: %s set membership wrong (Error)\n", print_char(i));
+                errors++;
+            }
+        }
+        free_tree(set);
+    }
+
+    // Integer set
+    {
+        int64_t integers[] = {1, 2, 3, 4, 5, 6, 7, 8, 9000, 100000};
+        HashNode *set = create_integer_set(integers, sizeof(integers) / sizeof(integers[0]));
+        int i;
+        for (i = 0; i < sizeof(integers) / sizeof(integers[0]); i++) {
+            if (!lookup_integer(integers[i], set, NULL)) {
+                printf("Integer: %lld not found in set (Error)\n", (long long)integers[i]);
+                errors++;
+            }
+        }
+        if (lookup_integer(9, set, NULL)) {
+            printf("Integer: 9 found in set (Error)\n");
+            errors++;
+        }
+        free_tree(set);
+    }
+
+    if (errors != 0) {
+        printf("There were %d errors\n", errors);
+    }
+    return errors;
+}
+
+// Full Test of sets
+int full_test_sets() {
+    int errors = 0;
+
+    printf("Testing Set Hashing - Edge Cases\n");
+    // Test with a single string
+    {
+        char *test[] = {"A"};
+        errors += a_string_set_test(test, 1);
+    }
+    // Test with a few different length strings
+    {
+        char *test[] = {"AB", "ABC", "ABCD", "ABCDE", "ABCDEF"};
+        errors += a_string_set_test(test, 5);
+    }
+    // Test with 2 identical strings - the set must not be created
+    {
+        BinaryValue test[2];
+        test[0].binary = (uint8_t*)"AB";
+        test[0].length = 2;
+        test[1] = test[0];
+        if (create_binary_set(test, 2) != NULL) {
+            printf("Error set created despite duplicates\n");
+            errors++;
+        }
+    }
+    // Test with a lot of values - 1000 strings - but with common prefixes
+    {
+        char *test[1000];
+        int i;
+        for (i = 0; i < 1000; i++) {
+            test[i] = (char *) malloc(100);
+            if (test[i] == NULL) {
+                // Handle memory allocation error - our standard is to exit with a PANIC message
+                fprintf(stderr, "PANIC: Memory allocation error\n");
+                exit(1);
+            }
+            sprintf(test[i], "PrefixString%d", i);
+        }
+        errors += a_string_set_test(test, 1000);
+        for (i = 0; i < 1000; i++) {
+            free(test[i]);
+        }
+    }
+
+    return errors;
+}
+
+// Test an approximate membership filter of null terminated strings
+int a_string_filter_test(char **strings, size_t num_strings, int fingerprint_bits) {
+    int errors = 0;
+    HashNode *filter;
+    int i;
+    int false_positives = 0;
+    int num_misses = 10000;
+    char miss[32];
+
+    filter = create_string_filter((uint8_t**)strings, num_strings, fingerprint_bits);
+    if (filter == NULL) {
+        printf("Error creating %d bit string filter\n", fingerprint_bits);
+        return 1;
+    }
+
+    // Members must always be found
+    for (i = 0; i < num_strings; i++) {
+        if (!lookup_string((uint8_t*)strings[i], filter, NULL)) {
+            printf("String: %s not found in %d bit filter (Error)\n", strings[i], fingerprint_bits);
+            errors++;
+        }
+    }
+
+    // Non-members may be found - but only at about the fingerprint false positive rate
+    for (i = 0; i < num_misses; i++) {
+        sprintf(miss, "NotAMember%d", i);
+        if (lookup_string((uint8_t*)miss, filter, NULL)) {
+            false_positives++;
+        }
+    }
+    printf("%d bit filter false positives: %d in %d\n", fingerprint_bits, false_positives, num_misses);
+    if (false_positives > num_misses / (1 << (fingerprint_bits > 16 ? 16 : fingerprint_bits)) * 4 + 2) {
+        printf("Error too many false positives for a %d bit filter\n", fingerprint_bits);
+        errors++;
+    }
+
+    free_tree(filter);
+
+    return errors;
+}
+
+// Full Test of filters
+int full_test_filters() {
+    int errors = 0;
+    char *test[1000];
+    int i;
+
+    printf("Testing Filter Hashing\n");
+
+    for (i = 0; i < 1000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "PrefixString%d", i);
+    }
+    errors += a_string_filter_test(test, 1000, 8);
+    errors += a_string_filter_test(test, 1000, 16);
+    errors += a_string_filter_test(test, 1000, 32);
+    errors += a_string_filter_test(test, 1, 8);
+
+    // Invalid fingerprint size
+    if (create_string_filter((uint8_t**)test, 1000, 12) != NULL) {
+        printf("Error filter created with 12 bit fingerprints\n");
+        errors++;
+    }
+    for (i = 0; i < 1000; i++) {
+        free(test[i]);
+    }
+
+    // Integer filter
+    {
+        int64_t integers[] = {1, 2, 3, 4, 5, 6, 7, 8, 9000, 100000};
+        HashNode *filter = create_integer_filter(integers, sizeof(integers) / sizeof(integers[0]), 16);
+        for (i = 0; i < sizeof(integers) / sizeof(integers[0]); i++) {
+            if (!lookup_integer(integers[i], filter, NULL)) {
+                printf("Integer: %lld not found in filter (Error)\n", (long long)integers[i]);
+                errors++;
+            }
+        }
+        free_tree(filter);
+    }
+
+    return errors;
+}
+
+// Test a retrieval only tree of null terminated strings
+int a_string_retrieval_test(char **strings, size_t num_strings) {
+    int errors = 0;
+    HashNode *hash_table;
+    int i;
+    Payload payload;
+    Payload *payloads = (Payload *)malloc(num_strings * sizeof(Payload));
+
+    // Create payloads
+    for (i = 0; i < num_strings; i++) {
+        payloads[i].integer = i;
+    }
+
+    hash_table = create_string_retrieval((uint8_t**)strings, payloads, num_strings);
+    if (hash_table == NULL) {
+        printf("Error creating string retrieval tree\n");
+        free(payloads);
+        return 1;
+    }
+
+    // Every member must return its payload (non-members return an arbitrary payload so are not tested)
+    for (i = 0; i < num_strings; i++) {
+        if (!lookup_string((uint8_t*)strings[i], hash_table, &payload)) {
+            printf("String: %s not found in retrieval tree (Error)\n", strings[i]);
+            errors++;
+        }
+        else if (payloads[i].integer != payload.integer) {
+            printf("String: %s found in retrieval tree but expected payload %d but got %d\n", strings[i], (int)payloads[i].integer, (int)payload.integer);
+            errors++;
+        }
+    }
+
+    free_tree(hash_table);
+    free(payloads);
+
+    return errors;
+}
+
+// Full Test of retrieval only trees
+int full_test_retrieval() {
+    int errors = 0;
+
+    printf("Testing Retrieval Hashing\n");
+    {
+        char *test[] = {"A"};
+        errors += a_string_retrieval_test(test, 1);
+    }
+    {
+        char *test[] = {"AB", "ABC", "ABCD", "ABCDE", "ABCDEF"};
+        errors += a_string_retrieval_test(test, 5);
+    }
+    {
+        char *test[1000];
+        int i;
+        for (i = 0; i < 1000; i++) {
+            test[i] = (char *) malloc(100);
+            if (test[i] == NULL) {
+                // Handle memory allocation error - our standard is to exit with a PANIC message
+                fprintf(stderr, "PANIC: Memory allocation error\n");
+                exit(1);
+            }
+            sprintf(test[i], "PrefixString%d", i);
+        }
+        errors += a_string_retrieval_test(test, 1000);
+        for (i = 0; i < 1000; i++) {
+            free(test[i]);
+        }
+    }
+    // Integer retrieval
+    {
+        int64_t integers[] = {1, 2, 3, 4, 5, 6, 7, 8, 9000, 100000};
+        Payload payloads[10];
+        Payload payload;
+        HashNode *hash_table;
+        int i;
+        for (i = 0; i < 10; i++) {
+            payloads[i].integer = integers[i] * 2;
+        }
+        hash_table = create_integer_retrieval(integers, payloads, 10);
+        for (i = 0; i < 10; i++) {
+            if (!lookup_integer(integers[i], hash_table, &payload) || payload.integer != integers[i] * 2) {
+                printf("Integer: %lld wrong payload in retrieval tree (Error)\n", (long long)integers[i]);
+                errors++;
+            }
+        }
+        free_tree(hash_table);
+    }
+
+    return errors;
+}
+
+// Test length dispatch
+int full_test_length_dispatch() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[1000];
+    int i;
+    Payload payload;
+
+    printf("Testing Length Dispatch\n");
+    init_build_options(&options);
+    options.length_dispatch = 1;
+    errors += full_test_binary_ex(&options);
+
+    // Mixed length identifiers - compare with and without length dispatch
+    for (i = 0; i < 1000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "id%d", i * 7919 % 100003);
+    }
+    {
+        HashNode *plain = create_string_set((uint8_t**)test, 1000);
+        HashNode *dispatched;
+        options.mode = ACPH_MODE_SET;
+        dispatched = create_string_hash_ex((uint8_t**)test, NULL, 1000, &options);
+        int slot_efficiency;
+        size_t plain_depth, dispatched_depth;
+        printf("Without length dispatch: ");
+        hash_table_efficiency(plain, &slot_efficiency, &plain_depth);
+        printf("With length dispatch:    ");
+        hash_table_efficiency(dispatched, &slot_efficiency, &dispatched_depth);
+        for (i = 0; i < 1000; i++) {
+            if (!lookup_string((uint8_t*)test[i], dispatched, &payload)) {
+                printf("String: %s not found with length dispatch (Error)\n", test[i]);
+                errors++;
+            }
+        }
+        // A length not in the set is rejected by the length node
+        if (lookup_string((uint8_t*)"id123456789", dispatched, NULL)) {
+            printf("Error 'id123456789' found with length dispatch\n");
+            errors++;
+        }
+        free_tree(plain);
+        free_tree(dispatched);
+    }
+
+    // Invalid options (on real keys - an empty build is NULL whatever the options)
+    options.mode = 99;
+    {
+        HashNode *invalid = create_string_hash_ex((uint8_t**)test, NULL, 1000, &options);
+        if (invalid != NULL) {
+            printf("Error tree created with an invalid mode\n");
+            errors++;
+            free_tree(invalid);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
 // Main Test Function
+int full_test_buckets() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[1000];
+    int i;
+    Payload payload;
+
+    printf("Testing Buckets\n");
+    init_build_options(&options);
+    options.bucket_size = ACPH_MAX_BUCKET_SIZE;
+    errors += full_test_binary_ex(&options);
+    options.bucket_size = 2;
+    errors += full_test_binary_ex(&options);
+
+    // Mixed length identifiers - compare with and without buckets
+    for (i = 0; i < 1000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "id%d", i * 7919 % 100003);
+    }
+    {
+        Payload payloads[1000];
+        HashNode *plain, *bucketed;
+        int slot_efficiency;
+        size_t plain_depth, bucketed_depth;
+        for (i = 0; i < 1000; i++) {
+            payloads[i].integer = i;
+        }
+        plain = create_string_hash((uint8_t**)test, payloads, 1000);
+        options.bucket_size = ACPH_MAX_BUCKET_SIZE;
+        bucketed = create_string_hash_ex((uint8_t**)test, payloads, 1000, &options);
+        printf("Without buckets: ");
+        hash_table_efficiency(plain, &slot_efficiency, &plain_depth);
+        printf("With buckets:    ");
+        hash_table_efficiency(bucketed, &slot_efficiency, &bucketed_depth);
+        if (bucketed_depth > plain_depth) {
+            printf("Error buckets made the tree deeper\n");
+            errors++;
+        }
+        for (i = 0; i < 1000; i++) {
+            if (!lookup_string((uint8_t*)test[i], bucketed, &payload) || payload.integer != i) {
+                printf("String: %s not found with buckets (Error)\n", test[i]);
+                errors++;
+            }
+        }
+        if (lookup_string((uint8_t*)"id1", bucketed, NULL) != lookup_string((uint8_t*)"id1", plain, NULL)) {
+            printf("Error 'id1' lookup differs with buckets\n");
+            errors++;
+        }
+        free_tree(plain);
+        free_tree(bucketed);
+    }
+
+    // Duplicates are still rejected when they would share a bucket
+    strcpy(test[0], "dup");
+    strcpy(test[1], "other");
+    strcpy(test[2], "dup");
+    options.mode = ACPH_MODE_SET;
+    if (create_string_hash_ex((uint8_t**)test, NULL, 3, &options) != NULL) {
+        printf("Error tree created with a duplicate in a bucket\n");
+        errors++;
+    }
+    for (i = 0; i < 3; i++) {
+        sprintf(test[i], "id%d", i * 7919 % 100003);
+    }
+
+    // Invalid options (on real keys - an empty build is NULL whatever the options)
+    options.bucket_size = ACPH_MAX_BUCKET_SIZE + 1;
+    {
+        HashNode *invalid = create_string_hash_ex((uint8_t**)test, NULL, 1000, &options);
+        if (invalid != NULL) {
+            printf("Error tree created with an invalid bucket size\n");
+            errors++;
+            free_tree(invalid);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_wide_columns() {
+    int errors = 0;
+    HashBuildOptions options;
+    int64_t integers[20000];
+    BinaryValue values[20000];
+    char *test[5000];
+    char missing[20];
+    Payload payloads[20000];
+    Payload payload;
+    uint64_t random = 88172645463325252ULL;
+    int i;
+
+    printf("Testing Wide Columns\n");
+    init_build_options(&options);
+    options.wide_columns = 1;
+    errors += full_test_binary_ex(&options);
+
+    // Random integers - large enough for the root to be a wide node
+    for (i = 0; i < 20000; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        integers[i] = (int64_t)random;
+        values[i].binary = (uint8_t *)&integers[i];
+        values[i].length = sizeof(int64_t);
+        payloads[i].integer = i;
+    }
+    {
+        HashNode *plain = create_binary_hash(values, payloads, 20000);
+        HashNode *wide = create_binary_hash_ex(values, payloads, 20000, &options);
+        int slot_efficiency;
+        size_t plain_depth, wide_depth;
+        printf("Without wide columns: ");
+        hash_table_efficiency(plain, &slot_efficiency, &plain_depth);
+        printf("With wide columns:    ");
+        hash_table_efficiency(wide, &slot_efficiency, &wide_depth);
+        if (wide_depth >= plain_depth) {
+            printf("Error wide columns did not save a level\n");
+            errors++;
+        }
+        for (i = 0; i < 20000; i++) {
+            int64_t missing = integers[i] ^ 0x100;
+            BinaryValue near_miss;
+            if (!lookup_binary(&values[i], wide, &payload) || payload.integer != i) {
+                printf("Integer %lld not found with wide columns (Error)\n", (long long)integers[i]);
+                errors++;
+            }
+            near_miss.binary = (uint8_t *)&missing;
+            near_miss.length = sizeof(int64_t);
+            if (lookup_binary(&near_miss, wide, NULL) != lookup_binary(&near_miss, plain, NULL)) {
+                printf("Integer %lld lookup differs with wide columns (Error)\n", (long long)missing);
+                errors++;
+            }
+        }
+        free_tree(plain);
+        free_tree(wide);
+    }
+
+    // Hex strings - wide nodes with lookup_string
+    for (i = 0; i < 5000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%08llx", (unsigned long long)(uint32_t)integers[i]);
+    }
+    options.mode = ACPH_MODE_SET;
+    {
+        HashNode *wide = create_string_hash_ex((uint8_t **)test, NULL, 5000, &options);
+        if (wide == NULL) {
+            printf("Error creating wide string set\n");
+            errors++;
+        }
+        else {
+            for (i = 0; i < 5000; i++) {
+                if (!lookup_string((uint8_t *)test[i], wide, NULL)) {
+                    printf("String: %s not found with wide columns (Error)\n", test[i]);
+                    errors++;
+                }
+                // Not a member - the leaves point to the test strings so change a copy
+                strcpy(missing, test[i]);
+                missing[7] = 'z';
+                if (lookup_string((uint8_t *)missing, wide, NULL)) {
+                    printf("Error '%s' found with wide columns\n", missing);
+                    errors++;
+                }
+            }
+            free_tree(wide);
+        }
+    }
+    for (i = 0; i < 5000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_pair_columns() {
+    int errors = 0;
+    char *test[10000];
+    char missing[20];
+    Payload payloads[10000];
+    Payload payload;
+    int i;
+
+    printf("Testing Pair Columns\n");
+
+    // Dates - each column only has a few digits so no single column splits the dates well
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%04d-%02d-%02d", 1990 + i / 336, 1 + (i / 28) % 12, 1 + i % 28);
+        payloads[i].integer = i;
+    }
+    {
+        HashNode *dates = create_string_hash((uint8_t **)test, payloads, 10000);
+        int slot_efficiency;
+        size_t depth;
+        if (dates == NULL) {
+            printf("Error creating date hash\n");
+            errors++;
+        }
+        else {
+            hash_table_efficiency(dates, &slot_efficiency, &depth);
+            if (depth > 4) {
+                printf("Error pair columns did not make the date tree shallower\n");
+                errors++;
+            }
+            for (i = 0; i < 10000; i++) {
+                if (!lookup_string((uint8_t *)test[i], dates, &payload) || payload.integer != i) {
+                    printf("Date: %s not found (Error)\n", test[i]);
+                    errors++;
+                }
+                // Not members - the leaves point to the test strings so change a copy (no day is over 28)
+                strcpy(missing, test[i]);
+                missing[8] = '3';
+                if (lookup_string((uint8_t *)missing, dates, NULL)) {
+                    printf("Error '%s' found\n", missing);
+                    errors++;
+                }
+                strcpy(missing, test[i]);
+                missing[0] = '9';
+                if (lookup_string((uint8_t *)missing, dates, NULL)) {
+                    printf("Error '%s' found\n", missing);
+                    errors++;
+                }
+            }
+            free_tree(dates);
+        }
+    }
+    for (i = 0; i < 10000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_column_scoring() {
+    int errors = 0;
+    HashBuildOptions options;
+    static const char *scoring_names[] = {"max occurrence", "entropy", "sum of squares"};
+    static const char *corpus_names[] = {"ids", "urls", "dates"};
+    char *test[10000];
+    int corpus, scoring, i, r;
+
+    printf("Testing Column Scoring\n");
+    init_build_options(&options);
+    options.column_scoring = ACPH_SCORE_ENTROPY;
+    errors += full_test_binary_ex(&options);
+    options.column_scoring = ACPH_SCORE_SUM_OF_SQUARES;
+    errors += full_test_binary_ex(&options);
+
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+    }
+    // The average depth and lookup time of each scoring policy for each corpus
+    for (corpus = 0; corpus < 3; corpus++) {
+        for (i = 0; i < 10000; i++) {
+            switch (corpus) {
+                case 0:
+                    sprintf(test[i], "id%d", i * 7919 % 100003);
+                    break;
+                case 1:
+                    sprintf(test[i], "https://www.example.com/p/%d/%s/index.html", i * 7, (i % 3) ? "abc" : "defgh");
+                    break;
+                default:
+                    sprintf(test[i], "%04d-%02d-%02d", 1990 + i / 336, 1 + (i / 28) % 12, 1 + i % 28);
+            }
+        }
+        for (scoring = 0; scoring < 3; scoring++) {
+            HashNode *set;
+            clock_t start;
+            int found = 0;
+            options.mode = ACPH_MODE_SET;
+            options.column_scoring = scoring;
+            set = create_string_hash_ex((uint8_t **)test, NULL, 10000, &options);
+            if (set == NULL) {
+                printf("Error creating %s set with %s scoring\n", corpus_names[corpus], scoring_names[scoring]);
+                errors++;
+                continue;
+            }
+            start = clock();
+            for (r = 0; r < 10; r++) {
+                for (i = 0; i < 10000; i++) {
+                    found += lookup_string((uint8_t *)test[i], set, NULL);
+                }
+            }
+            printf("%s, %s scoring: average depth %.3f, lookup %.1f ns\n", corpus_names[corpus], scoring_names[scoring],
+                   hash_table_average_depth(set), (double)(clock() - start) / CLOCKS_PER_SEC / 100000 * 1e9);
+            if (found != 10 * 10000) {
+                printf("Error %d %s not found with %s scoring\n", 10 * 10000 - found, corpus_names[corpus], scoring_names[scoring]);
+                errors++;
+            }
+            free_tree(set);
+        }
+    }
+
+    // Invalid options - on keys that every column choice splits (the first column is taken when no column scores)
+    for (i = 0; i < 10; i++) {
+        sprintf(test[i], "%d-%d", i, i * 7);
+    }
+    options.column_scoring = 3;
+    {
+        HashNode *invalid = create_string_hash_ex((uint8_t**)test, NULL, 10, &options);
+        if (invalid != NULL) {
+            printf("Error tree created with an invalid column scoring\n");
+            errors++;
+            free_tree(invalid);
+        }
+    }
+    for (i = 0; i < 10000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_beam_search() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[10000];
+    int i;
+
+    printf("Testing Beam Search\n");
+    init_build_options(&options);
+    options.beam_width = 4;
+    errors += full_test_binary_ex(&options);
+
+    // URLs - compare the greedy build with the beam search
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "https://www.example.com/p/%d/%s/index.html", i * 7, (i % 3) ? "abc" : "defgh");
+    }
+    options.mode = ACPH_MODE_SET;
+    {
+        HashNode *greedy = create_string_set((uint8_t **)test, 10000);
+        HashNode *beam = create_string_hash_ex((uint8_t **)test, NULL, 10000, &options);
+        double greedy_depth = hash_table_average_depth(greedy);
+        double beam_depth = hash_table_average_depth(beam);
+        printf("Average depth greedy: %.3f, beam search: %.3f\n", greedy_depth, beam_depth);
+        if (beam_depth >= greedy_depth) {
+            printf("Error the beam search did not make the tree shallower\n");
+            errors++;
+        }
+        for (i = 0; i < 10000; i++) {
+            if (!lookup_string((uint8_t *)test[i], beam, NULL)) {
+                printf("String: %s not found with beam search (Error)\n", test[i]);
+                errors++;
+            }
+        }
+        if (lookup_string((uint8_t *)"https://www.example.com/p/7/defgh/index.html", beam, NULL)) {
+            printf("Error non-member found with beam search\n");
+            errors++;
+        }
+        free_tree(greedy);
+        free_tree(beam);
+    }
+
+    // Invalid options (on real keys - an empty build is NULL whatever the options)
+    options.beam_width = ACPH_MAX_BEAM_WIDTH + 1;
+    {
+        HashNode *invalid = create_string_hash_ex((uint8_t**)test, NULL, 10000, &options);
+        if (invalid != NULL) {
+            printf("Error tree created with an invalid beam width\n");
+            errors++;
+            free_tree(invalid);
+        }
+    }
+    for (i = 0; i < 10000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_weighted() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[10000];
+    double weights[10000];
+    double plain_cost = 0, weighted_cost = 0, beam_cost = 0, total_weight = 0;
+    int i;
+
+    printf("Testing Weighted Build\n");
+    // Zipfian weights - key i is the (i+1)th most popular
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "id%ld", i * 7919L % 1000003);
+        weights[i] = 1.0 / (i + 1);
+    }
+    init_build_options(&options);
+    options.mode = ACPH_MODE_SET;
+    {
+        HashNode *plain = create_string_hash_ex((uint8_t **)test, NULL, 10000, &options);
+        HashNode *weighted, *beam;
+        options.weights = weights;
+        weighted = create_string_hash_ex((uint8_t **)test, NULL, 10000, &options);
+        options.beam_width = 4;
+        beam = create_string_hash_ex((uint8_t **)test, NULL, 10000, &options);
+        if (plain == NULL || weighted == NULL || beam == NULL) {
+            printf("Error creating weighted sets\n");
+            errors++;
+        }
+        else {
+            // The expected number of nodes visited by a lookup
+            for (i = 0; i < 10000; i++) {
+                BinaryValue value;
+                value.binary = (uint8_t *)test[i];
+                value.length = strlen(test[i]);
+                plain_cost += weights[i] * (double)lookup_binary_depth(&value, plain);
+                weighted_cost += weights[i] * (double)lookup_binary_depth(&value, weighted);
+                beam_cost += weights[i] * (double)lookup_binary_depth(&value, beam);
+                total_weight += weights[i];
+                if (!lookup_string((uint8_t *)test[i], weighted, NULL) || !lookup_string((uint8_t *)test[i], beam, NULL)) {
+                    printf("String: %s not found with weights (Error)\n", test[i]);
+                    errors++;
+                }
+            }
+            printf("Expected depth plain: %.4f, weighted: %.4f, weighted beam search: %.4f\n",
+                   plain_cost / total_weight, weighted_cost / total_weight, beam_cost / total_weight);
+            if (weighted_cost >= plain_cost || beam_cost > weighted_cost) {
+                printf("Error the weights did not lower the expected depth\n");
+                errors++;
+            }
+        }
+        free_tree(plain);
+        free_tree(weighted);
+        free_tree(beam);
+    }
+    for (i = 0; i < 10000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_relayout() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[10000];
+    Payload payloads[10000];
+    Payload payload;
+    BinaryValue trace[20000];
+    uint64_t random = 88172645463325252ULL;
+    int i, mode;
+
+    printf("Testing Relayout\n");
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "https://www.example.com/p/%d/%s/index.html", i * 7, (i % 3) ? "abc" : "defgh");
+        payloads[i].integer = i;
+    }
+    // A skewed trace - most lookups are of the first 100 keys, plus some misses
+    for (i = 0; i < 20000; i++) {
+        int key;
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        key = (int)(random % 10) ? (int)(random % 100) : (int)(random % 10000);
+        trace[i].binary = (uint8_t *)test[key];
+        trace[i].length = strlen(test[key]);
+        if (i % 50 == 0) {
+            trace[i].binary = (uint8_t *)"https://www.example.com/p/7/defgh/index.html";
+            trace[i].length = strlen((char *)trace[i].binary);
+        }
+    }
+    {
+        HashNode *root = create_string_hash((uint8_t **)test, payloads, 10000);
+        HashNode *packed = relayout_tree(root, trace, 20000);
+        if (hash_table_average_depth(packed) != hash_table_average_depth(root)) {
+            printf("Error the packed tree has a different shape\n");
+            errors++;
+        }
+        // The packed tree has its own copies of the keys
+        free_tree(root);
+        for (i = 0; i < 10000; i++) {
+            char key[100];
+            strcpy(key, test[i]);
+            free(test[i]);
+            test[i] = NULL;
+            if (!lookup_string((uint8_t *)key, packed, &payload) || payload.integer != i) {
+                printf("String: %s not found in the packed tree (Error)\n", key);
+                errors++;
+            }
+            key[strlen(key) - 1] = 'x';
+            if (lookup_string((uint8_t *)key, packed, NULL)) {
+                printf("String: %s found in the packed tree (Error)\n", key);
+                errors++;
+            }
+        }
+        free_tree(packed);
+    }
+
+    // Every mode and node kind - without a trace
+    for (i = 0; i < 10000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%08x", (unsigned int)(i * 2654435761u));
+    }
+    for (mode = ACPH_MODE_HASH; mode <= ACPH_MODE_RETRIEVAL; mode++) {
+        HashNode *root, *packed;
+        init_build_options(&options);
+        options.mode = mode;
+        options.bucket_size = mode == ACPH_MODE_HASH ? 4 : 0;
+        options.wide_columns = mode == ACPH_MODE_SET;
+        root = create_string_hash_ex((uint8_t **)test, payloads, 10000, &options);
+        packed = relayout_tree(root, NULL, 0);
+        free_tree(root);
+        for (i = 0; i < 10000; i++) {
+            payload.integer = -1;
+            if (!lookup_string((uint8_t *)test[i], packed, &payload) ||
+                ((mode == ACPH_MODE_HASH || mode == ACPH_MODE_RETRIEVAL) && payload.integer != i)) {
+                printf("String: %s not found in the packed tree in mode %d (Error)\n", test[i], mode);
+                errors++;
+            }
+        }
+        if (mode != ACPH_MODE_FILTER && mode != ACPH_MODE_RETRIEVAL && lookup_string((uint8_t *)"0000000g", packed, NULL)) {
+            printf("Error non-member found in the packed tree in mode %d\n", mode);
+            errors++;
+        }
+        free_tree(packed);
+    }
+    for (i = 0; i < 10000; i++) {
+        free(test[i]);
+    }
+    if (relayout_tree(NULL, NULL, 0) != NULL) {
+        printf("Error packed an empty tree\n");
+        errors++;
+    }
+
+    return errors;
+}
+
+int full_test_max_depth() {
+    int errors = 0;
+    HashBuildOptions options;
+    char *test[2000];
+    BinaryValue values[2000];
+    int i, mode;
+
+    printf("Testing Max Depth\n");
+    init_build_options(&options);
+    options.max_depth = 4;
+    errors += full_test_binary_ex(&options);
+
+    // Keys of '0' and '1' characters - each column splits them in two so the greedy tree is deep
+    for (i = 0; i < 2000; i++) {
+        uint32_t bits = (uint32_t)(i * 2654435761u) & 0xffffff;
+        int j;
+        test[i] = (char *) malloc(25);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        for (j = 0; j < 24; j++) {
+            test[i][j] = (char)('0' + (bits >> j & 1));
+        }
+        test[i][24] = 0;
+        values[i].binary = (uint8_t *)test[i];
+        values[i].length = 24;
+    }
+    for (mode = ACPH_MODE_SET; mode <= ACPH_MODE_FILTER; mode++) {
+        HashNode *greedy, *bounded;
+        size_t greedy_depth = 0, bounded_depth = 0;
+        init_build_options(&options);
+        options.mode = mode;
+        greedy = create_binary_hash_ex(values, NULL, 2000, &options);
+        // Wide nodes split the keys 4 ways, so 6 levels are enough (buckets, or in filters collision free nodes, last)
+        options.max_depth = 6;
+        bounded = create_binary_hash_ex(values, NULL, 2000, &options);
+        if (greedy == NULL || bounded == NULL) {
+            printf("Error creating trees in mode %d\n", mode);
+            errors++;
+            free_tree(greedy);
+            free_tree(bounded);
+            continue;
+        }
+        for (i = 0; i < 2000; i++) {
+            size_t depth = lookup_binary_depth(&values[i], greedy);
+            if (depth > greedy_depth) {
+                greedy_depth = depth;
+            }
+            depth = lookup_binary_depth(&values[i], bounded);
+            if (depth > bounded_depth) {
+                bounded_depth = depth;
+            }
+            if (!lookup_binary(&values[i], bounded, NULL)) {
+                printf("String: %s not found with a max depth (Error)\n", test[i]);
+                errors++;
+            }
+        }
+        printf("Mode %d worst case depth greedy: %d, max depth 6: %d\n", mode, (int)greedy_depth, (int)bounded_depth);
+        if (bounded_depth > 6 || greedy_depth <= 6) {
+            printf("Error the max depth was not met\n");
+            errors++;
+        }
+        if (mode == ACPH_MODE_SET) {
+            // Other keys must be looked up the same with a max depth
+            if (lookup_string((uint8_t *)"111111111111111111111111", bounded, NULL) !=
+                lookup_string((uint8_t *)"111111111111111111111111", greedy, NULL)) {
+                printf("Error the lookup of a non-member differs with a max depth\n");
+                errors++;
+            }
+            // 4 levels of 4 way nodes and a bucket hold at most 1024 keys
+            options.max_depth = 5;
+            if (create_binary_hash_ex(values, NULL, 2000, &options) != NULL) {
+                printf("Error tree created with an impossible max depth\n");
+                errors++;
+            }
+        }
+        free_tree(greedy);
+        free_tree(bounded);
+    }
+
+    // A bound far below what 64K keys of 20 bits (one per byte) need must fail quickly, not search every column
+    {
+        uint8_t *bits = (uint8_t *)malloc(65536 * 20);
+        BinaryValue *keys = (BinaryValue *)malloc(65536 * sizeof(BinaryValue));
+        HashNode *root;
+        clock_t start;
+        double seconds;
+        if (bits == NULL || keys == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        for (i = 0; i < 65536; i++) {
+            int j;
+            for (j = 0; j < 20; j++) {
+                bits[i * 20 + j] = (uint8_t)(((uint32_t)i * 2654435761u) >> (j + 4) & 1);
+            }
+            keys[i].binary = &bits[i * 20];
+            keys[i].length = 20;
+        }
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.max_depth = 7;
+        start = clock();
+        root = create_binary_hash_ex(keys, NULL, 65536, &options);
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("Max depth 7 over 64K keys failed in %.3f s\n", seconds);
+        if (root != NULL || seconds > 1.0) {
+            printf("Error an impossible max depth was not rejected quickly\n");
+            errors++;
+        }
+        free_tree(root);
+        // 16 levels can hold them
+        options.max_depth = 16;
+        root = create_binary_hash_ex(keys, NULL, 65536, &options);
+        if (root == NULL || !lookup_binary(&keys[12345], root, NULL)) {
+            printf("Error no tree with a max depth the keys can meet\n");
+            errors++;
+        }
+        free_tree(root);
+        free(keys);
+        free(bits);
+    }
+
+    // Duplicates and invalid options
+    init_build_options(&options);
+    options.max_depth = 6;
+    values[1] = values[0];
+    if (create_binary_hash_ex(values, NULL, 2000, &options) != NULL) {
+        printf("Error tree created with duplicates and a max depth\n");
+        errors++;
+    }
+    options.max_depth = -1;
+    if (create_binary_hash_ex(values, NULL, 1, &options) != NULL) {
+        printf("Error tree created with an invalid max depth\n");
+        errors++;
+    }
+    for (i = 0; i < 2000; i++) {
+        free(test[i]);
+    }
+
+    return errors;
+}
+
+int full_test_space_budget() {
+    int errors = 0;
+    HashBuildOptions options;
+    char **test = (char **) malloc(100000 * sizeof(char *));
+    int i, budget_used;
+
+    printf("Testing Space Budget\n");
+    if (test == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    init_build_options(&options);
+    options.max_bytes = (size_t)1 << 30;
+    errors += full_test_binary_ex(&options);
+
+    // Hex strings - wide nodes are fast but large (about 90 bytes a key, and about 60 without them)
+    for (i = 0; i < 100000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%08x", (unsigned int)(i * 2654435761u));
+    }
+    init_build_options(&options);
+    options.mode = ACPH_MODE_SET;
+    options.wide_columns = 1;
+    {
+        HashNode *fast = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        size_t fast_bytes = hash_table_bytes(fast);
+        HashNode *small, *same;
+        options.max_bytes = fast_bytes * 3 / 4;
+        small = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        options.max_bytes = fast_bytes;
+        same = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        if (small == NULL || same == NULL) {
+            printf("Error creating sets within a space budget\n");
+            errors++;
+        }
+        else {
+            printf("Without a budget: %lu bytes, average depth %.3f\n", (unsigned long)fast_bytes,
+                   hash_table_average_depth(fast));
+            hash_table_budget(small, fast_bytes * 3 / 4, &budget_used);
+            printf("Within the budget: average depth %.3f\n", hash_table_average_depth(small));
+            if (budget_used > 100 || hash_table_bytes(same) != fast_bytes) {
+                printf("Error the space budget was not kept\n");
+                errors++;
+            }
+            for (i = 0; i < 100000; i++) {
+                if (!lookup_string((uint8_t *)test[i], small, NULL)) {
+                    printf("String: %s not found within a space budget (Error)\n", test[i]);
+                    errors++;
+                }
+            }
+            if (lookup_string((uint8_t *)"0000000g", small, NULL)) {
+                printf("Error non-member found within a space budget\n");
+                errors++;
+            }
+        }
+        free_tree(fast);
+        free_tree(small);
+        free_tree(same);
+    }
+
+    // Each key needs at least a slot and a leaf
+    options.max_bytes = 100000 * 16;
+    if (create_string_hash_ex((uint8_t **)test, NULL, 100000, &options) != NULL) {
+        printf("Error tree created with an impossible space budget\n");
+        errors++;
+    }
+    for (i = 0; i < 100000; i++) {
+        free(test[i]);
+    }
+    free(test);
+
+    return errors;
+}
+
+int full_test_effort() {
+    int errors = 0;
+    HashBuildOptions options;
+    char **test = (char **) malloc(20000 * sizeof(char *));
+    HashNode *trees[4];
+    double seconds[4];
+    const char *names[4] = {"fast", "balanced", "thorough", "out of time"};
+    int i, t;
+
+    printf("Testing Build Effort\n");
+    if (test == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    init_build_options(&options);
+    options.effort = ACPH_EFFORT_FAST;
+    errors += full_test_binary_ex(&options);
+    init_build_options(&options);
+    options.time_budget = 1e-9;
+    errors += full_test_binary_ex(&options);
+
+    // URLs - large enough that fast builds score the columns of the first nodes on a sample, and the beam search
+    // of a thorough build finds a shallower tree than the greedy one
+    for (i = 0; i < 20000; i++) {
+        test[i] = (char *) malloc(100);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "https://www.example.com/p/%d/%s/index.html", i * 7, (i % 3) ? "abc" : "defgh");
+    }
+    for (t = 0; t < 4; t++) {
+        clock_t start = clock();
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.effort = t == 0 ? ACPH_EFFORT_FAST : t == 1 ? ACPH_EFFORT_BALANCED : ACPH_EFFORT_THOROUGH;
+        options.time_budget = t == 3 ? 1e-9 : 0;
+        trees[t] = create_string_hash_ex((uint8_t **)test, NULL, 20000, &options);
+        seconds[t] = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (trees[t] == NULL) {
+            printf("Error creating a %s build\n", names[t]);
+            errors++;
+            continue;
+        }
+        printf("Effort %s: average depth %.3f, %d bytes, %.3f s\n", names[t], hash_table_average_depth(trees[t]),
+               (int)hash_table_bytes(trees[t]), seconds[t]);
+        for (i = 0; i < 20000; i++) {
+            if (!lookup_string((uint8_t *)test[i], trees[t], NULL)) {
+                printf("String: %s not found in a %s build (Error)\n", test[i], names[t]);
+                errors++;
+            }
+        }
+        if (lookup_string((uint8_t *)"https://www.example.com/p/7/defgh/index.html", trees[t], NULL)) {
+            printf("Error non-member found in a %s build\n", names[t]);
+            errors++;
+        }
+    }
+    if (trees[1] != NULL && trees[2] != NULL &&
+        hash_table_average_depth(trees[2]) >= hash_table_average_depth(trees[1])) {
+        printf("Error thorough build is not shallower than the balanced build\n");
+        errors++;
+    }
+    // Out of time the thorough build drops its beam search and builds as a fast build would
+    if (trees[0] != NULL && trees[3] != NULL &&
+        (hash_table_average_depth(trees[3]) != hash_table_average_depth(trees[0]) ||
+         hash_table_bytes(trees[3]) != hash_table_bytes(trees[0]) || seconds[3] > 1.0)) {
+        printf("Error thorough build with no time left was not built as a fast build\n");
+        errors++;
+    }
+    for (t = 0; t < 4; t++) {
+        free_tree(trees[t]);
+    }
+
+    // Keys whose first character only varies on every 19th key - the keys a fast build samples from 20000 - so
+    // the fast build splits on it and the balanced build (scoring every key) on a digit
+    for (i = 0; i < 20000; i++) {
+        sprintf(test[i], "%c%05d", i % 19 ? 'z' : 'A' + i / 19 % 50, i);
+    }
+    for (t = 0; t < 2; t++) {
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.effort = t == 0 ? ACPH_EFFORT_FAST : ACPH_EFFORT_BALANCED;
+        trees[t] = create_string_hash_ex((uint8_t **)test, NULL, 20000, &options);
+        if (trees[t] == NULL) {
+            printf("Error creating a sampled %s build\n", names[t]);
+            errors++;
+            continue;
+        }
+        for (i = 0; i < 20000; i++) {
+            if (!lookup_string((uint8_t *)test[i], trees[t], NULL)) {
+                printf("String: %s not found in a sampled %s build (Error)\n", test[i], names[t]);
+                errors++;
+            }
+        }
+    }
+    if (trees[0] != NULL && trees[1] != NULL) {
+        printf("Sampled keys average depth fast: %.3f, balanced: %.3f\n", hash_table_average_depth(trees[0]),
+               hash_table_average_depth(trees[1]));
+        if (hash_table_average_depth(trees[0]) <= hash_table_average_depth(trees[1])) {
+            printf("Error fast build did not score the columns on a sample\n");
+            errors++;
+        }
+    }
+    free_tree(trees[0]);
+    free_tree(trees[1]);
+
+    // Duplicates are still found in a sampled group
+    strcpy(test[19999], test[0]);
+    init_build_options(&options);
+    options.mode = ACPH_MODE_SET;
+    options.effort = ACPH_EFFORT_FAST;
+    if (create_string_hash_ex((uint8_t **)test, NULL, 20000, &options) != NULL) {
+        printf("Error duplicate not found in a fast build\n");
+        errors++;
+    }
+
+    // Invalid settings
+    init_build_options(&options);
+    options.effort = 3;
+    if (create_string_hash_ex((uint8_t **)test, NULL, 100, &options) != NULL) {
+        printf("Error tree created with an invalid effort\n");
+        errors++;
+    }
+    init_build_options(&options);
+    options.time_budget = -1;
+    if (create_string_hash_ex((uint8_t **)test, NULL, 100, &options) != NULL) {
+        printf("Error tree created with a negative time budget\n");
+        errors++;
+    }
+    for (i = 0; i < 20000; i++) {
+        free(test[i]);
+    }
+    free(test);
+
+    return errors;
+}
+
+// Progress seen by test_progress_callback() - and the flag it sets to cancel a build half way
+typedef struct TestProgress {
+    size_t calls;
+    size_t keys_placed;
+    size_t nodes_created;
+    size_t cancel_at;
+    volatile int cancel;
+} TestProgress;
+
+void test_progress_callback(size_t keys_placed, size_t nodes_created, void *progress_data) {
+    TestProgress *progress = (TestProgress *)progress_data;
+    progress->calls++;
+    progress->keys_placed = keys_placed;
+    progress->nodes_created = nodes_created;
+    if (progress->cancel_at && keys_placed >= progress->cancel_at) {
+        progress->cancel = 1;
+    }
+}
+
+int full_test_progress() {
+    int errors = 0;
+    HashBuildOptions options;
+    TestProgress progress;
+    char **test = (char **) malloc(100000 * sizeof(char *));
+    HashNode *hash;
+    int i, t;
+
+    printf("Testing Build Progress and Cancel\n");
+    if (test == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < 100000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%08x", (unsigned int)(i * 2654435761u));
+    }
+
+    // The final counts are the keys and nodes of the tree - also when subtrees are rebuilt
+    for (t = 0; t < 3; t++) {
+        memset(&progress, 0, sizeof(progress));
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.progress = test_progress_callback;
+        options.progress_data = &progress;
+        if (t == 1) {
+            options.beam_width = 2;
+        }
+        if (t == 2) {
+            options.max_depth = 3;
+            options.bucket_size = 4;
+        }
+        hash = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        if (hash == NULL) {
+            printf("Error creating a set with a progress callback\n");
+            errors++;
+            continue;
+        }
+        printf("Progress: %lu calls, %lu keys placed in %lu nodes\n", (unsigned long)progress.calls,
+               (unsigned long)progress.keys_placed, (unsigned long)progress.nodes_created);
+        if (progress.calls < 2 || progress.keys_placed != 100000 || progress.nodes_created == 0) {
+            printf("Error wrong build progress\n");
+            errors++;
+        }
+        free_tree(hash);
+    }
+
+    // Cancelled half way through - and before the build starts
+    for (t = 0; t < 2; t++) {
+        memset(&progress, 0, sizeof(progress));
+        progress.cancel_at = 50000;
+        progress.cancel = t;
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.progress = test_progress_callback;
+        options.progress_data = &progress;
+        options.cancel = &progress.cancel;
+        if (create_string_hash_ex((uint8_t **)test, NULL, 100000, &options) != NULL) {
+            printf("Error cancelled build returned a tree\n");
+            errors++;
+        }
+        if (progress.keys_placed > 50000 + 16384) {
+            printf("Error cancelled build went on\n");
+            errors++;
+        }
+    }
+    for (i = 0; i < 100000; i++) {
+        free(test[i]);
+    }
+    free(test);
+
+    return errors;
+}
+
+int full_test_parallel() {
+    int errors = 0;
+    HashBuildOptions options;
+    char **test = (char **) malloc(100000 * sizeof(char *));
+    HashNode *single, *parallel;
+    int i, t;
+
+    printf("Testing Parallel Builds\n");
+    if (test == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    init_build_options(&options);
+    options.threads = 4;
+    options.parallel_threshold = 0;
+    errors += full_test_binary_ex(&options);
+
+    for (i = 0; i < 100000; i++) {
+        test[i] = (char *) malloc(60);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        if (i % 2) {
+            sprintf(test[i], "https://www.example.com/p/%d/%s/index.html", i * 7, (i % 3) ? "abc" : "defgh");
+        }
+        else {
+            sprintf(test[i], "%08x", (unsigned int)(i * 2654435761u));
+        }
+    }
+
+    // The tree built on threads is the same as the single threaded one
+    for (t = 0; t < 2; t++) {
+        init_build_options(&options);
+        options.mode = ACPH_MODE_SET;
+        options.length_dispatch = t;
+        options.wide_columns = t;
+        single = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        options.threads = 3;
+        options.parallel_threshold = 1000;
+        parallel = create_string_hash_ex((uint8_t **)test, NULL, 100000, &options);
+        if (single == NULL || parallel == NULL) {
+            printf("Error creating a set on threads\n");
+            errors++;
+        }
+        else {
+            printf("Threads: average depth %.3f, %lu bytes\n", hash_table_average_depth(parallel),
+                   (unsigned long)hash_table_bytes(parallel));
+            if (hash_table_bytes(parallel) != hash_table_bytes(single) ||
+                hash_table_average_depth(parallel) != hash_table_average_depth(single)) {
+                printf("Error tree built on threads differs from the single threaded tree\n");
+                errors++;
+            }
+            for (i = 0; i < 100000; i++) {
+                if (!lookup_string((uint8_t *)test[i], parallel, NULL)) {
+                    printf("String: %s not found in a set built on threads (Error)\n", test[i]);
+                    errors++;
+                }
+            }
+        }
+        free_tree(single);
+        free_tree(parallel);
+    }
+
+    init_build_options(&options);
+    options.threads = ACPH_MAX_THREADS + 1;
+    if (create_string_hash_ex((uint8_t **)test, NULL, 100, &options) != NULL) {
+        printf("Error tree created with too many threads\n");
+        errors++;
+    }
+    for (i = 0; i < 100000; i++) {
+        free(test[i]);
+    }
+    free(test);
+
+    return errors;
+}
+
+int full_test_simd_levels() {
+    int errors = 0;
+    HashBuildOptions options;
+    char **test = (char **) malloc(20000 * sizeof(char *));
+    HashNode *scalar = NULL;
+    int i, level, best = simd_level();
+    const char *names[4] = {"scalar", "SSE4.2", "AVX2", "AVX-512"};
+
+    printf("Testing SIMD Levels (best %s)\n", names[best]);
+    if (test == NULL) {
+        // Handle memory allocation error - our standard is to exit with a PANIC message
+        fprintf(stderr, "PANIC: Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < 20000; i++) {
+        test[i] = (char *) malloc(20);
+        if (test[i] == NULL) {
+            // Handle memory allocation error - our standard is to exit with a PANIC message
+            fprintf(stderr, "PANIC: Memory allocation error\n");
+            exit(1);
+        }
+        sprintf(test[i], "%d", i * 37);
+    }
+
+    // Every level the CPU supports builds the same tree
+    init_build_options(&options);
+    options.mode = ACPH_MODE_SET;
+    for (level = ACPH_SIMD_SCALAR; level <= ACPH_SIMD_AVX512; level++) {
+        HashNode *hash;
+        if (!force_simd_level(level)) {
+            if (level <= best) {
+                printf("Error %s level not supported\n", names[level]);
+                errors++;
+            }
+            continue;
+        }
+        if (level > best || simd_level() != level) {
+            printf("Error %s level forced wrongly\n", names[level]);
+            errors++;
+        }
+        hash = create_string_hash_ex((uint8_t **)test, NULL, 20000, &options);
+        if (hash == NULL) {
+            printf("Error creating a set at the %s level\n", names[level]);
+            errors++;
+            continue;
+        }
+        if (scalar == NULL) {
+            scalar = hash;
+            continue;
+        }
+        if (hash_table_bytes(hash) != hash_table_bytes(scalar) ||
+            hash_table_average_depth(hash) != hash_table_average_depth(scalar)) {
+            printf("Error %s level built a different tree\n", names[level]);
+            errors++;
+        }
+        free_tree(hash);
+    }
+    free_tree(scalar);
+
+    if (force_simd_level(ACPH_SIMD_AVX512 + 1) || !force_simd_level(ACPH_SIMD_AUTO) || simd_level() != best) {
+        printf("Error SIMD level not restored\n");
+        errors++;
+    }
+    for (i = 0; i < 20000; i++) {
+        free(test[i]);
+    }
+    free(test);
+
+    return errors;
+}
+
 int main() {
     int errors = 0;
 
@@ -902,6 +2530,7 @@ int main() {
     errors += test_strings();
     errors += test_integers();
     errors += test_doubles();
+    errors += test_sets();
 
     // Full Test
     printf("Full Testing ACPH\n");
@@ -910,6 +2539,23 @@ int main() {
     errors += full_test_strings();
     errors += full_test_integers();
     errors += full_test_doubles();
+    errors += full_test_sets();
+    errors += full_test_filters();
+    errors += full_test_retrieval();
+    errors += full_test_length_dispatch();
+    errors += full_test_buckets();
+    errors += full_test_wide_columns();
+    errors += full_test_pair_columns();
+    errors += full_test_column_scoring();
+    errors += full_test_beam_search();
+    errors += full_test_weighted();
+    errors += full_test_relayout();
+    errors += full_test_max_depth();
+    errors += full_test_space_budget();
+    errors += full_test_effort();
+    errors += full_test_progress();
+    errors += full_test_parallel();
+    errors += full_test_simd_levels();
 
     if (errors == 0) {
         printf("All tests passed\n");